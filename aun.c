@@ -1,273 +1,1586 @@
-/* File Server Emulator   */
-/* aun.c                  */
-/* (c) 2021 Martin Mather */
-
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/time.h>//timeval
-#include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <malloc.h>
-#include <time.h>
-
-#include "aun.h"
-#include "ebuf.h"
-
-static struct aun_t {
-	uint32_t in_addr;
-	struct sockaddr_in si;
-	uint32_t rxhandle;
-	time_t rxtime;
-	uint32_t txhandle;
-} stations[AUN_MAX_STATIONS], *stnp, *stntx;
-
-static struct sockaddr_in si_me, si_other;
-static int mysock, slen = sizeof(si_other), rxlen;
-static uint8_t *rxbuf = NULL;
-static uint16_t mystn, otherstn;
-static uint8_t riscos_mode = 0;
-
-static void die(char *s) {
-	perror(s);
-	exit(1);
-}
-
-static void _opensock(in_addr_t listen_addr) {
-	//create a UDP socket
-	if ((mysock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
-		die("socket");
-	
-	//zero out the structure
-	memset((char *) &si_me, 0, sizeof(si_me));
-	
-	si_me.sin_family = AF_INET;
-        if (listen_addr == INADDR_ANY)
-                si_me.sin_port = htons(AUN_PORT_BASE + mystn);
-        else
-        {
-                si_me.sin_port = htons(32768);
-                riscos_mode = 1;
-        }
-        si_me.sin_addr.s_addr = listen_addr;
-
-	//bind socket to port
-	if (bind(mysock, (struct sockaddr*) &si_me, sizeof(si_me)) == -1)
-		die("bind");
-
-	//set receive timeout
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 1000000/3;
-	
-	if (setsockopt(mysock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-		die("set sock opt");
-}
-
-static void _sendack(void) {
-	rxbuf[0] = AUN_TYPE_ACK;//reuse rest of received header
-	if (sendto(mysock, rxbuf, AUN_HDR_SIZE, 0, (struct sockaddr*) &si_other, slen) == -1)
-		die("sendto()");
-	//printf("ACK SENT\n");
-}
-
-static void _sendmachinetype(void) {
-	//printf("send immediate reply ack\n");
-	rxbuf[0] = AUN_TYPE_IMM_REPLY;//reuse rest of received header
-	rxbuf[8] = 1;//bbc micro
-	rxbuf[9] = 0;
-	rxbuf[10] = 0x60;//nfs x.60
-	rxbuf[11] = 3;//nfs 3.xx
-	if (sendto(mysock, rxbuf, AUN_HDR_SIZE + 4, 0, (struct sockaddr*) &si_other, slen) == -1)
-		die("sendto()");
-}
-
-static int _gotdata(int ackwait) {
-	uint8_t port;
-	uint32_t handle;
-	int received = 0;
-
-	//printf("ip=%08x\n", stnp->in_addr);
-	//for (int i = 0; i < rxlen; i++)
-	//	printf("%02x ", rxbuf[i]);
-	//printf("\n");
-
-	port = rxbuf[1];
-	handle = rxbuf[7] << 24 | rxbuf[6] << 16 | rxbuf[5] << 8 | rxbuf[4];
-
-	//printf("AUN:RX type=%02x port=%02x cb=%02x handle=%08x\n", rxbuf[0], port, rxbuf[2], handle);
-
-	switch (rxbuf[0]) {// type
-		case AUN_TYPE_UNICAST:
-			//printf("UNICAST\n");
-			if (!ackwait) {
-				if ((handle > stnp->rxhandle) || (time(0) > stnp->rxtime)) {
-					stnp->rxhandle = handle;
-					stnp->rxtime = time(0) + AUN_RXTIMEOUT;
-			
-					struct ebuf_t *p = ebuf_rxfind(otherstn, port);
-					if (p) {
-						//printf("ebuf %d found\n", p->index);
-
-						if (rxlen <= (p->len + AUN_HDR_SIZE)) {
-							_sendack();// do this first
-							p->station = otherstn;//from station
-							p->port = port;//to port
-							p->control = rxbuf[2] | 0x80;//control byte
-							ebuf_bind(p, rxbuf, rxlen);
-							p->state = EB_STATE_RECEIVED;
-							
-							received = 1;// WE RECEIVED DATA
-							rxbuf = NULL;
-						} else
-							printf("AUN:buffer too small\n");
-					} else
-						printf("AUN:ebuf not found\n");
-				} else if (handle == stnp->rxhandle) {
-					_sendack();//duplicate of last packet, send ack
-				}// else duplicate of old packet, ignore
-			} // else we're waiting for an ACK
-			break;
-		case AUN_TYPE_ACK:
-			//printf("ACK RECEIVED\n");
-			if (ackwait) {
-				if (stnp == stntx && handle == stnp->txhandle)
-					received = 1;// WE RECEIVED AN ACK TO LAST TRANSMISSION
-			}// else not expecting an ACK
-			break;
-		case AUN_TYPE_IMMEDIATE:
-			//printf("IMM %02x : ", rxbuf[2]);//control byte
-			//for (int i = 8; i < rxlen && i < 32; i++)
-			//	printf("%02x ", rxbuf[i]);
-			//printf("\n");
-			switch (rxbuf[2]) {//control byte
-				case ECONET_MACHINEPEEK:
-					//printf("MACHINE PEEK\n");
-					_sendmachinetype();
-					break;
-				default:
-					//printf("Unhandled\n");
-					break;
-			}
-			break;
-		case AUN_TYPE_IMM_REPLY:
-		default:
-			//printf("Type?\n");
-			break;
-	}
-	
-	return received;
-}
-
-int aun_receiver(int ackwait) {
-	
-	int received = 0;
-	
-	if (!rxbuf)
-		rxbuf = malloc(AUN_RXBUFLEN);
-
-	if (rxbuf)
-		rxlen = recvfrom(mysock, rxbuf, AUN_RXBUFLEN, 0, (struct sockaddr *) &si_other, &slen);
-	else
-		rxlen = 0;
-
-	if (rxlen == -1) {
-		if (errno != EWOULDBLOCK) 
-			die("recvfrom()");
-	} else if (rxlen >= AUN_HDR_SIZE) {
-		//printf("Received packet from %s:%d length=%d\n", inet_ntoa(si_other.sin_addr), ntohs(si_other.sin_port), rxlen);
-                if (riscos_mode && ntohs(si_other.sin_port) == 32768)
-                        otherstn = ntohl(si_other.sin_addr.s_addr) & 255;
-                else
-		  otherstn = ntohs(si_other.sin_port) - AUN_PORT_BASE;
-		//printf("stn=%d\n", otherstn);
-		if (otherstn < AUN_MAX_STATIONS) {
-			if (otherstn == mystn) 
-				printf("AUN:Duplicate station %d\n", otherstn);
-			else {
-				stnp = &stations[otherstn];
-				uint32_t in_addr = ntohl(si_other.sin_addr.s_addr);
-				if (stnp->in_addr == 0) {
-					//printf("New station\n");
-					stnp->in_addr = in_addr;
-					stnp->si = si_other;
-				}
-				
-				if (stnp->in_addr != in_addr)
-					printf("AUN:Duplicate station %d\n", otherstn);
-				else {
-					//printf("Station OK\n");
-					received = _gotdata(ackwait);
-				}
-			}
-		} else
-			printf("AUN:Station number out of range\n");
-	}
-	
-	return received;
-}
-
-
-int aun_transmitter(int retry) {
-	struct ebuf_t *p = ebuf_txfind();//ALWAYS ebufs[0]
-	int send = 0;
-
-	//printf("tx %d %d %04x %02x\n", p->index, p->state, p->station, p->port);
-	if (p->station < AUN_MAX_STATIONS) {
-		stntx = &stations[p->station]; 
-
-		if (stntx->in_addr) {
-				//pop AUN header
-				if (!retry)
-					stntx->txhandle += 4;
-
-				uint8_t *hdr = p->buf2;
-				uint32_t handle = stntx->txhandle;
-
-				hdr[0] = AUN_TYPE_UNICAST;
-				hdr[1] = p->port;
-				hdr[2] = p->control & 0x7f;
-				hdr[3] = 0;
-				hdr[4] = handle & 0xff;
-				hdr[5] = (handle >> 8) & 0xff;
-				hdr[6] = (handle >> 16) & 0xff;
-				hdr[7] = (handle >> 24) & 0xff;
-
-				//printf("AUN:TX type=%02x port=%02x cb=%02x handle=%08x\n", hdr[0], p->port, hdr[2], handle);
-				send = 1;
-		} else	{
-			printf("TX: stn doesn't have an ip address!\n");
-		}
-
-		if (send) {
-			//printf("TX: Sending packet to %s:%d length=%d, handle=%08x\n", 
-			//		inet_ntoa(stntx->si.sin_addr), ntohs(stntx->si.sin_port), p->len2, stntx->txhandle);
-			if (sendto(mysock, p->buf2, p->len2, 0, (struct sockaddr*) &stntx->si, slen) == -1)
-				die("sendto()");
-		}
-	} //else station number out of range
-	
-	return send;
-}
-
-
-int aun_open(uint16_t stn, in_addr_t listen_addr) {
-	//printf("aun_open stn=%d\n", stn);
-
-	mystn = stn;	// remember my station number
-	ebuf_open(AUN_MAX_BUFFERS);
-	_opensock(listen_addr);
-}
-
-int aun_close(void) {
-	//printf("aun_close\n");
-	close(mysock);
-	ebuf_close();
-}
-
-
+/* File Server Emulator   */
+/* aun.c                  */
+/* (c) 2021 Martin Mather */
+
+/* The AUN socket is owned by an I/O thread, which does the ACKs,     */
+/* duplicate suppression, retransmissions and immediate replies.      */
+/* Data packets and transmit requests pass between it and the         */
+/* emulator thread through single producer/consumer lock-free rings.  */
+/* Co-located clients can use a Unix domain datagram socket instead of */
+/* UDP, with the same AUN framing and handling.                        */
+/* Packets pass through an optional impairment stage on the way in and */
+/* out, see impair.c.  Counters can be read through the control      */
+/* socket, see ctl.c, which the I/O thread also serves.  Datagrams    */
+/* can be captured as they are sent and received, see pcap.c.          */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "aun.h"
+#include "ebuf.h"
+#include "tick.h"
+#include "imm.h"
+#include "ring.h"
+#include "sched.h"
+#include "impair.h"
+#include "fsop.h"
+#include "ctl.h"
+#include "pcap.h"
+#include "log.h"
+#include "rt.h"
+
+union aunaddr_t {//peer address, UDP or local
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+};
+
+struct aunmsg_t {//passed between the threads
+	uint16_t station;
+	unsigned seq;//of a transmission
+	int result;//EB_RESULT_x of a transmission
+	uint32_t time;//ms, when received
+	uint32_t us;//when received, for fsop
+	int len;
+	uint8_t *buf;//including the AUN header
+	struct aunmsg_t *next;//in a station's transmit queue
+};
+
+static struct aun_t {
+	uint16_t addr;//(net << 8) | stn
+	uint8_t mapped;//address fixed by the map file
+	struct aun_t *hnext, *next;//ip:port hash chain, all stations
+
+	union aunaddr_t si;
+	socklen_t alen;//0 until we know where it is
+	struct listener_t *via;//socket the station talks to us through
+	uint32_t rxhandle;
+	time_t rxtime;
+	uint8_t rxheld;//rxhandle is with the emulator, ACKed once it's delivered
+	uint32_t txhandle;
+
+	uint64_t txtime;//when the current transmission was (re)sent, us
+	int txretry;//attempt number of the current transmission
+	uint32_t srtt, rttvar;//smoothed RTT and its variance, us (0 = no sample)
+	uint32_t retransmits, timeouts, txfailed;
+
+	struct aunmsg_t *txq, *txtail;//head is being transmitted
+	int txqlen;
+	uint32_t txdeadline;//ms, for the ACK to the head of txq
+	struct aun_t *txnext;//stations with something to transmit
+	uint8_t txlisted;//in that list
+
+	struct {//last command port request and the reply to it
+		uint32_t handle, hash;
+		uint32_t time;//ms, when the request arrived
+		int state;//CACHE_x
+		uint8_t *reply;//whole packet, header included
+		int len;
+	} cache;
+	uint32_t cachehits;
+
+	uint32_t rxpackets, txpackets, duplicates;
+	uint64_t rxbytes, txbytes;
+	uint32_t lastseen;//ms
+	uint32_t bufmisses;//no RXCB for it, counted by either thread
+	uint32_t scheddrops;//command port requests the scheduler gave up on, emulator thread
+} *stations[AUN_MAX_STATIONS], *iphash[AUN_HASH_SIZE], *stnlist, *stnp, *txactive;
+
+#define AUN_TYPE_DROPPED	0x80//not on the wire, the emulator couldn't take a packet
+
+//I/O thread
+static struct listener_t {
+	int sock;
+	int riscos;//derive station numbers from the last octet
+	int local;//Unix domain socket
+	int bcast;//only receives broadcasts
+	struct listener_t *out;//replies go through this one
+	union aunaddr_t si;
+} listeners[AUN_MAX_LISTENERS], *lrx;//lrx = the one that just received
+static int nlisteners;
+static union aunaddr_t si_other;
+static int rxlen;
+static socklen_t slen;
+static uint8_t *rxbuf = NULL;
+static uint16_t mystn;
+static int rto_min = AUN_RTO_MIN, rto_max = AUN_RTO_MAX, rto_backoff = AUN_RTO_BACKOFF;
+static int tx_attempts = AUN_TX_RETRIES;
+static struct sockaddr_in bcastaddr;//subnet broadcast, sin_family is 0 if there isn't one
+static char discname[17];//answer "read discs" broadcasts with this, if set
+static uint32_t bcasthandle, bcasts_rx, bcasts_tx, bcasts_answered;
+static uint8_t lastbcast[AUN_HDR_SIZE + 32];//so ours don't come back to us
+static int lastbcastlen;
+
+#define CACHE_EMPTY	0
+#define CACHE_WAITING	1//request given to the FS, no reply yet
+#define CACHE_REPLIED	2
+#define CACHE_UNUSABLE	3//more than one packet sent back, can't replay it
+
+static uint32_t cache_bytes, cache_hits, cache_busy, cache_misses, cache_skipped;
+
+static struct delayed_t {//held back by the impairment stage
+	uint32_t due;//ms
+	int dir;
+	uint16_t station;
+	struct listener_t *l;
+	union aunaddr_t si;
+	socklen_t alen;
+	uint8_t *buf;
+	int len;
+	struct delayed_t *next;
+} *delayed;
+
+//shared
+static pthread_t iothread;
+static int evpipe[2], cmdpipe[2];//wake the emulator, wake the I/O thread
+static struct ring_t rxring, txring, resring;
+static struct {//written by the emulator thread, read for the control socket
+	uint64_t instructions, scsiops, wakeups;
+	uint32_t kips, iops, wakeups_s;//per second, over the last second or so
+} pub;
+static char *ctlpath;
+
+//emulator thread
+static struct aunmsg_t *pending[AUN_PENDING];//received, waiting for an RXCB
+static int pend_count;
+static unsigned txseq;
+static struct {//result of each recent transmission, by sequence number
+	unsigned seq;
+	uint8_t status;//EB_STATUS_x
+} txres[AUN_TXRESULTS];
+static uint32_t pubtime;
+static uint64_t pubinstructions, pubscsiops, pubwakeups;
+
+#define PUB_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define PUB_STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+
+static void die(char *s) {
+	perror(s);
+	exit(1);
+}
+
+static socklen_t _unixaddr(union aunaddr_t *a, char *path) {
+	memset(a, 0, sizeof(*a));
+	a->un.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(a->un.sun_path))
+		return 0;
+	strcpy(a->un.sun_path, path);
+	return offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+}
+
+static char *_addrstr(union aunaddr_t *a) {
+	static char buf[sizeof(a->un.sun_path) + 8];
+
+	if (a->sa.sa_family == AF_UNIX)
+		snprintf(buf, sizeof(buf), "unix:%s", a->un.sun_path);
+	else
+		snprintf(buf, sizeof(buf), "%s:%d", inet_ntoa(a->in.sin_addr), ntohs(a->in.sin_port));
+	return buf;
+}
+
+static void _opensock(char *spec) {
+	//spec is mode[:ip.address[:port]], mode is "beebem" or "riscos"
+	//eg "beebem" = 0.0.0.0:10000+stn, "riscos:192.168.1.100" = 192.168.1.100:32768
+	//or "unix:/path" for a Unix domain datagram socket
+	char buf[128], *mode, *ip, *port;
+	struct listener_t *l = &listeners[nlisteners];
+	socklen_t len = sizeof(l->si.in);
+
+	if (nlisteners == AUN_MAX_LISTENERS) {
+		log_msg(LOGC_AUN, LOGL_ERROR, "Too many listeners");
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	mode = strtok(buf, ":");
+	ip = strtok(NULL, ":");
+	port = strtok(NULL, ":");
+
+	//zero out the structure
+	memset((char *) &l->si, 0, sizeof(l->si));
+	
+	l->si.in.sin_family = AF_INET;
+	if (mode && !strcmp(mode, "riscos")) {
+		l->riscos = 1;
+		l->si.in.sin_port = htons(port ? atoi(port) : 32768);
+	} else if (mode && !strcmp(mode, "beebem"))
+		l->si.in.sin_port = htons(port ? atoi(port) : AUN_PORT_BASE + mystn);
+	else if (mode && !strcmp(mode, "unix") && ip) {
+		l->local = 1;
+		if (!(len = _unixaddr(&l->si, spec + 5))) {
+			log_msg(LOGC_AUN, LOGL_ERROR, "Socket path too long '%s'", spec + 5);
+			exit(1);
+		}
+		unlink(l->si.un.sun_path);//left over from last time
+	} else {
+		log_msg(LOGC_AUN, LOGL_ERROR, "Bad listener '%s'", spec);
+		exit(1);
+	}
+	if (l->local)
+		;
+	else if (!ip)
+		l->si.in.sin_addr.s_addr = INADDR_ANY;
+	else if (inet_pton(AF_INET, ip, &l->si.in.sin_addr) != 1) {
+		log_msg(LOGC_AUN, LOGL_ERROR, "Bad listener address '%s'", ip);
+		exit(1);
+	}
+
+	//create a UDP (or local datagram) socket
+	if (l->local)
+		l->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	else
+		l->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (l->sock == -1)
+		die("socket");
+
+	//bind socket to port
+	if (bind(l->sock, &l->si.sa, len) == -1)
+		die("bind");
+	fcntl(l->sock, F_SETFL, O_NONBLOCK);
+	l->out = l;
+
+	log_msg(LOGC_AUN, LOGL_INFO, "Listening on %s (%s)", _addrstr(&l->si), mode);
+	nlisteners++;
+}
+
+static void _openbcast(void) {
+	//Let the IP listeners send broadcasts, and receive them on the AUN
+	//port of the broadcast address unless a listener on any address does.
+	struct listener_t *l = &listeners[nlisteners], *out = NULL;
+	int on = 1;
+
+	for (int i = 0; i < nlisteners; i++) {
+		if (listeners[i].local)
+			continue;
+		setsockopt(listeners[i].sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+		if (!out || (listeners[i].riscos && !out->riscos))
+			out = &listeners[i];
+	}
+	if (!out) {
+		log_msg(LOGC_AUN, LOGL_WARN, "Broadcasts need an IP listener");
+		return;
+	}
+	if (out->riscos && out->si.in.sin_addr.s_addr == INADDR_ANY
+			&& ntohs(out->si.in.sin_port) == 32768)
+		return;//already hears them
+	if (nlisteners == AUN_MAX_LISTENERS) {
+		log_msg(LOGC_AUN, LOGL_ERROR, "Too many listeners");
+		return;
+	}
+
+	memset(l, 0, sizeof(*l));
+	l->si.in = bcastaddr;
+	l->riscos = 1;
+	l->bcast = 1;
+	l->out = out;
+	if ((l->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+		die("socket");
+	setsockopt(l->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(l->sock, &l->si.sa, sizeof(l->si.in)) == -1) {
+		log_msg(LOGC_AUN, LOGL_WARN, "Couldn't listen for broadcasts on %s", _addrstr(&l->si));
+		close(l->sock);
+		return;
+	}
+	fcntl(l->sock, F_SETFL, O_NONBLOCK);
+
+	log_msg(LOGC_AUN, LOGL_INFO, "Listening on %s (broadcasts)", _addrstr(&l->si));
+	nlisteners++;
+}
+
+static unsigned _addrhash(union aunaddr_t *a) {
+	uint32_t h;
+
+	if (a->sa.sa_family == AF_UNIX) {
+		h = 2166136261u;
+		for (char *c = a->un.sun_path; *c; c++)
+			h = (h ^ (uint8_t) *c) * 16777619u;
+	} else
+		h = ntohl(a->in.sin_addr.s_addr) ^ (ntohs(a->in.sin_port) << 16);
+	h *= 2654435761u;
+	return h >> 24 & (AUN_HASH_SIZE - 1);
+}
+
+static int _pathstn(char *path) {
+	//station number from the digits at the end of a local socket's path
+	char *c = path + strlen(path);
+
+	while (c > path && c[-1] >= '0' && c[-1] <= '9')
+		c--;
+	return *c ? atoi(c) : -1;
+}
+
+static int _addreq(union aunaddr_t *a, union aunaddr_t *b) {
+	if (a->sa.sa_family != b->sa.sa_family)
+		return 0;
+	if (a->sa.sa_family == AF_UNIX)
+		return !strcmp(a->un.sun_path, b->un.sun_path);
+	return a->in.sin_addr.s_addr == b->in.sin_addr.s_addr && a->in.sin_port == b->in.sin_port;
+}
+
+static struct aun_t *_station(uint16_t addr) {//find or create
+	struct aun_t *s = stations[addr];
+
+	if (!s) {
+		s = calloc(1, sizeof(struct aun_t));
+		if (!s)
+			die("calloc");
+		s->addr = addr;
+		s->next = stnlist;
+		stnlist = s;
+		stations[addr] = s;
+	}
+	return s;
+}
+
+static void _bindstation(struct aun_t *s, union aunaddr_t *si, socklen_t len) {
+	s->si = *si;
+	s->alen = len;
+
+	struct aun_t **h = &iphash[_addrhash(si)];
+	s->hnext = *h;
+	*h = s;
+}
+
+static struct aun_t *_addrfind(union aunaddr_t *si) {
+	struct aun_t *s = iphash[_addrhash(si)];
+
+	while (s && !_addreq(&s->si, si))
+		s = s->hnext;
+	return s;
+}
+
+static void _rttsample(struct aun_t *s) {
+	//RFC 6298 estimator, only fed by unretried transmissions (Karn)
+	uint32_t r = tick_us() - s->txtime;
+
+	if (!s->srtt) {
+		s->srtt = r ? r : 1;
+		s->rttvar = r / 2;
+	} else {
+		uint32_t d = (r > s->srtt) ? r - s->srtt : s->srtt - r;
+		s->rttvar = (3 * s->rttvar + d) / 4;
+		s->srtt = (7 * s->srtt + r) / 8;
+	}
+}
+
+static int _rto(struct aun_t *s) {//ms
+	int rto;
+
+	if (!s->srtt)
+		rto = AUN_RTO_INIT;
+	else
+		rto = (s->srtt + 4 * s->rttvar + 999) / 1000;
+
+	if (rto < rto_min)
+		rto = rto_min;
+	if (rto > rto_max)
+		rto = rto_max;
+	return rto;
+}
+
+static void _wake(int fd, char c) {
+	if (write(fd, &c, 1) == -1 && errno != EAGAIN)
+		die("write()");
+}
+
+/* I/O thread */
+
+static void _delay(int dir, struct listener_t *l, union aunaddr_t *si, socklen_t alen,
+		uint16_t stn, uint8_t *buf, int len, int ms) {
+	//Hold a copy of a packet back for a while, in order of release time.
+	struct delayed_t *d = malloc(sizeof(struct delayed_t)), **dp = &delayed;
+
+	if (!d)
+		return;
+	if (!(d->buf = malloc(dir == IMPAIR_RX ? AUN_RXBUFLEN : len))) {
+		free(d);
+		return;
+	}
+	memcpy(d->buf, buf, len);
+	d->len = len;
+	d->dir = dir;
+	d->station = stn;
+	d->l = l;
+	d->si = *si;
+	d->alen = alen;
+	d->due = tick_ms() + ms;
+
+	while (*dp && (int32_t) (d->due - (*dp)->due) >= 0)
+		dp = &(*dp)->next;
+	d->next = *dp;
+	*dp = d;
+}
+
+static void _inaddr(union aunaddr_t *a, uint16_t stn, uint32_t *ip, uint16_t *port) {
+	//IPv4 address for a capture record, local sockets get 127.0.net.stn:32768
+	if (a->sa.sa_family == AF_UNIX) {
+		*ip = 0x7f000000 | (stn & 0xffff);
+		*port = 32768;
+	} else {
+		*ip = ntohl(a->in.sin_addr.s_addr);
+		*port = ntohs(a->in.sin_port);
+	}
+}
+
+static void _capture(struct listener_t *l, union aunaddr_t *peer, int out, uint8_t *buf, int len) {
+	uint32_t us, them;
+	uint16_t usport, themport;
+	int stn = -1;
+
+	if (peer->sa.sa_family == AF_UNIX)
+		stn = _pathstn(peer->un.sun_path);
+	_inaddr(&l->si, mystn, &us, &usport);
+	_inaddr(peer, stn < 0 ? 0xffff : stn, &them, &themport);
+	if (out)
+		pcap_packet(us, usport, them, themport, buf, len);
+	else
+		pcap_packet(them, themport, us, usport, buf, len);
+}
+
+static void _sendto(struct listener_t *l, union aunaddr_t *si, socklen_t alen, uint8_t *buf, int len) {
+	if (sendto(l->sock, buf, len, 0, &si->sa, alen) == -1) {
+		//a local client that has gone away looks like a lost packet,
+		//anything else is logged and lost, the retries will cope
+		if (errno != ECONNREFUSED && errno != ENOENT && errno != EAGAIN)
+			log_msg(LOGC_AUN, LOGL_WARN, "sendto() %s: %s", _addrstr(si), strerror(errno));
+	} else
+		_capture(l, si, 1, buf, len);
+}
+
+static void _send(struct listener_t *l, union aunaddr_t *si, socklen_t alen, uint16_t stn, uint8_t *buf, int len) {
+	int delay[2], n = impair_packet(stn, IMPAIR_TX, delay);
+	struct aun_t *s = stations[stn];
+
+	if (s) {
+		s->txpackets++;
+		s->txbytes += len;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (delay[i])
+			_delay(IMPAIR_TX, l, si, alen, stn, buf, len, delay[i]);
+		else
+			_sendto(l, si, alen, buf, len);
+	}
+}
+
+static void _sendack(void) {
+	uint8_t ack[AUN_HDR_SIZE];
+	memcpy(ack, rxbuf, AUN_HDR_SIZE);
+	ack[0] = AUN_TYPE_ACK;//reuse rest of received header
+	_send(lrx, &si_other, slen, stnp->addr, ack, AUN_HDR_SIZE);
+	//printf("ACK SENT\n");
+}
+
+static void _immediate(void) {
+	int len = imm_reply(rxbuf, rxlen, AUN_RXBUFLEN);
+	if (len)
+		_send(lrx, &si_other, slen, stnp->addr, rxbuf, len);
+}
+
+static int _txtimeout(struct aun_t *s) {//ms to wait for the ACK to attempt 'txretry'
+	int rto = _rto(s);
+
+	for (int retry = s->txretry; retry > 0 && rto < rto_max; retry--)
+		rto = (rto > rto_max / rto_backoff) ? rto_max : rto * rto_backoff;//no overflow
+
+	return (rto > rto_max) ? rto_max : rto;
+}
+
+static void _txsend(struct aun_t *s) {
+	struct aunmsg_t *m = s->txq;
+	uint8_t *hdr = m->buf;
+	uint32_t handle = s->txhandle;
+
+	s->txtime = tick_us();
+	s->txdeadline = tick_ms() + _txtimeout(s);
+
+	hdr[0] = AUN_TYPE_UNICAST;//port and control byte are already there
+	hdr[3] = 0;
+	hdr[4] = handle & 0xff;
+	hdr[5] = (handle >> 8) & 0xff;
+	hdr[6] = (handle >> 16) & 0xff;
+	hdr[7] = (handle >> 24) & 0xff;
+
+	//printf("TX: Sending packet to %s:%d length=%d, handle=%08x\n", 
+	//		_addrstr(&s->si), m->len, handle);
+	_send(s->via, &s->si, s->alen, s->addr, m->buf, m->len);
+}
+
+static void _txbegin(struct aun_t *s) {//start on the head of the queue
+	s->txhandle += 4;
+	s->txretry = 0;
+	_txsend(s);
+}
+
+static void _txresult(struct aunmsg_t *m, int result) {
+	free(m->buf);
+	m->buf = NULL;
+	m->result = result;
+	if (!m->seq)//one of ours, nobody's waiting for it
+		free(m);
+	else if (ring_put(&resring, m))
+		_wake(evpipe[1], 'x');
+	else
+		free(m);//emulator isn't keeping up
+}
+
+static void _txdone(struct aun_t *s, int result) {
+	struct aunmsg_t *m = s->txq;
+
+	s->txq = m->next;
+	s->txqlen--;
+	if (result != EB_RESULT_SUCCESSFUL) {
+		s->txfailed++;
+		log_msg(LOGC_AUN, LOGL_WARN, "TX to %u.%u failed, port %02x, %u so far",
+			s->addr >> 8, s->addr & 0xff, m->buf[1], s->txfailed);
+	}
+	_txresult(m, result);
+
+	if (s->txq)
+		_txbegin(s);//next one for this station
+}
+
+static void _cacheclear(struct aun_t *s) {
+	if (s->cache.reply) {
+		cache_bytes -= s->cache.len;
+		free(s->cache.reply);
+		s->cache.reply = NULL;
+	}
+	s->cache.state = CACHE_EMPTY;
+}
+
+static void _cachereply(struct aun_t *s, struct aunmsg_t *m) {
+	//The first packet back after a request is the reply, keep a copy
+	if (s->cache.state == CACHE_WAITING) {
+		if (m->len > AUN_CACHE_MAXREPLY || cache_bytes + m->len > AUN_CACHE_BYTES
+				|| !(s->cache.reply = malloc(m->len))) {
+			cache_skipped++;
+			s->cache.state = CACHE_UNUSABLE;
+		} else {
+			memcpy(s->cache.reply, m->buf, m->len);
+			s->cache.len = m->len;
+			cache_bytes += m->len;
+			s->cache.state = CACHE_REPLIED;
+		}
+	} else if (s->cache.state == CACHE_REPLIED) {
+		_cacheclear(s);
+		s->cache.state = CACHE_UNUSABLE;
+	}
+}
+
+static void _txenqueue(struct aun_t *s, struct aunmsg_t *m) {
+	if (s->txqlen >= AUN_TXQUEUE) {
+		log_msg(LOGC_AUN, LOGL_WARN, "TX queue full for stn %d.%d", AUN_NET(s->addr), AUN_STN(s->addr));
+		s->txfailed++;
+		_txresult(m, EB_RESULT_OTHER);
+	} else {
+		m->next = NULL;
+		s->txqlen++;
+		if (s->txq)
+			s->txtail->next = m;
+		else {
+			s->txq = m;
+			if (!s->txlisted) {
+				s->txlisted = 1;
+				s->txnext = txactive;
+				txactive = s;
+			}
+			_txbegin(s);
+		}
+		s->txtail = m;
+	}
+}
+
+static void _broadcast(struct aunmsg_t *m) {
+	//Send to the broadcast address through the RISC OS style listeners,
+	//and to each station we know on the others, which have no broadcast.
+	//Nothing acknowledges a broadcast, it's done once it's sent.
+	uint8_t *hdr = m->buf;
+	uint32_t handle = bcasthandle += 4;
+	union aunaddr_t to;
+
+	hdr[0] = AUN_TYPE_BROADCAST;
+	hdr[3] = 0;
+	hdr[4] = handle & 0xff;
+	hdr[5] = (handle >> 8) & 0xff;
+	hdr[6] = (handle >> 16) & 0xff;
+	hdr[7] = (handle >> 24) & 0xff;
+	lastbcastlen = m->len < sizeof(lastbcast) ? m->len : sizeof(lastbcast);
+	memcpy(lastbcast, m->buf, lastbcastlen);
+
+	if (bcastaddr.sin_family) {
+		to.in = bcastaddr;
+		for (int i = 0; i < nlisteners; i++)
+			if (listeners[i].riscos && !listeners[i].bcast)
+				_send(&listeners[i], &to, sizeof(to.in), AUN_BROADCAST, m->buf, m->len);
+	}
+	for (struct aun_t *s = stnlist; s; s = s->next)
+		if (s->alen && s->via && !s->via->riscos)
+			_send(s->via, &s->si, s->alen, s->addr, m->buf, m->len);
+
+	bcasts_tx++;
+	_txresult(m, EB_RESULT_SUCCESSFUL);
+}
+
+static void _rxdone(struct aun_t *s, struct aunmsg_t *m) {
+	//The emulator has finished with a received packet.  ACK it now it's
+	//in an RXCB, or if it was dropped let the sender's retry through.
+	uint8_t *hdr = m->buf;
+	uint32_t handle = hdr[7] << 24 | hdr[6] << 16 | hdr[5] << 8 | hdr[4];
+
+	if (s && s->rxheld && handle == s->rxhandle) {
+		s->rxheld = 0;
+		if (hdr[0] == AUN_TYPE_ACK) {
+			if (s->alen && s->via)
+				_send(s->via, &s->si, s->alen, s->addr, hdr, AUN_HDR_SIZE);
+		} else {
+			s->rxtime = 0;//same handle is new again
+			if (hdr[1] == SCHED_PORT)
+				_cacheclear(s);
+		}
+	}
+	_txresult(m, EB_RESULT_SUCCESSFUL);
+}
+
+static void _txqueue(void) {
+	//Take new transmissions from the emulator and queue them per station.
+	//Stations are independent, one slow station doesn't hold up the others.
+	struct aunmsg_t *m;
+
+	while ((m = ring_get(&txring))) {
+		struct aun_t *s = stations[m->station];
+
+		if (m->buf[0] == AUN_TYPE_ACK || m->buf[0] == AUN_TYPE_DROPPED)
+			_rxdone(s, m);
+		else if (m->buf[0] == AUN_TYPE_IMM_REPLY) {//sent once, no ACK
+			if (s && s->alen && s->via)
+				_send(s->via, &s->si, s->alen, s->addr, m->buf, m->len);
+			_txresult(m, EB_RESULT_SUCCESSFUL);
+		} else if (m->station == AUN_BROADCAST)
+			_broadcast(m);
+		else if (!s || !s->alen || !s->via) {
+			log_msg(LOGC_AUN, LOGL_WARN, "TX stn doesn't have an ip address!");
+			_txresult(m, EB_RESULT_OTHER);
+		} else {
+			_cachereply(s, m);
+			_txenqueue(s, m);
+		}
+	}
+}
+
+static int _txtimer(void) {
+	//Retransmit or give up on anything whose ACK is overdue.
+	//Returns ms until the next deadline, or -1 if nothing's waiting.
+	uint32_t now = tick_ms();
+	int wait = -1;
+
+	for (struct aun_t **sp = &txactive; *sp; ) {
+		struct aun_t *s = *sp;
+
+		if (s->txq && (int32_t) (now - s->txdeadline) >= 0) {
+			//printf("ACK TIMEOUT\n");
+			s->timeouts++;
+
+			if (++s->txretry < tx_attempts) {
+				s->retransmits++;
+				_txsend(s);
+			} else
+				_txdone(s, EB_RESULT_TIMEDOUT);
+		}
+
+		if (!s->txq) {//idle, drop out of the list
+			*sp = s->txnext;
+			s->txnext = NULL;
+			s->txlisted = 0;
+			continue;
+		}
+
+		int32_t left = s->txdeadline - now;
+		if (left < 0)
+			left = 0;
+		if (wait < 0 || left < wait)
+			wait = left;
+		sp = &s->txnext;
+	}
+
+	return wait;
+}
+
+static uint32_t _hash(uint8_t *p, int len) {//FNV-1a
+	uint32_t h = 2166136261u;
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static int _cachecheck(uint32_t handle) {
+	//A new command port request.  Returns 1 if it's a retransmission of
+	//the last one, which has been dealt with, or 0 to pass it to the FS.
+	struct aun_t *s = stnp;
+	uint32_t h = _hash(rxbuf + 1, 2) ^ _hash(rxbuf + AUN_HDR_SIZE, rxlen - AUN_HDR_SIZE);
+
+	if (s->cache.state != CACHE_EMPTY && handle == s->cache.handle && h == s->cache.hash) {
+		if (s->cache.state == CACHE_WAITING) {
+			if ((int32_t) (tick_ms() - s->cache.time) < sched_maxage(0)) {
+				cache_busy++;//FS is still working on it
+				return 1;
+			}//else it was probably dropped, let it through again
+		} else if (s->cache.state == CACHE_REPLIED) {
+			struct aunmsg_t *m = malloc(sizeof(struct aunmsg_t));
+			uint8_t *b = malloc(s->cache.len);
+
+			if (m && b) {
+				memcpy(b, s->cache.reply, s->cache.len);
+				m->station = s->addr;
+				m->seq = 0;
+				m->buf = b;
+				m->len = s->cache.len;
+				_txenqueue(s, m);
+				cache_hits++;
+				s->cachehits++;
+				return 1;
+			}
+			free(m);
+			free(b);
+		}
+	}
+
+	_cacheclear(s);
+	s->cache.handle = handle;
+	s->cache.hash = h;
+	s->cache.time = tick_ms();
+	s->cache.state = CACHE_WAITING;
+	cache_misses++;
+	return 0;
+}
+
+static struct aunmsg_t *_rxmsg(void) {
+	//Wrap up the received packet for the emulator.
+	struct aunmsg_t *m = malloc(sizeof(struct aunmsg_t));
+
+	if (m) {
+		m->station = stnp->addr;//from station
+		m->buf = rxbuf;
+		m->len = rxlen;
+		m->time = tick_ms();
+		m->us = (uint32_t) tick_us();
+	}
+	return m;
+}
+
+static void _fsdiscs(void) {
+	//Answer "read discs" on the command port for the FS, this is how
+	//clients look for file servers and there's no need to wait for it.
+	//Request is replyport, 14, URD, CSD, LIB, first drive, number of drives.
+	//Reply is 10, 0, number, then drive number and 16 character name each.
+	uint8_t *a = rxbuf + AUN_HDR_SIZE;
+	int first = (rxlen > AUN_HDR_SIZE + 5) ? a[5] : 0;
+	int count = (rxlen > AUN_HDR_SIZE + 6) ? a[6] : 1;
+	int n = (first == 0 && count > 0) ? 1 : 0;//just the one drive
+	struct aunmsg_t *m = malloc(sizeof(struct aunmsg_t));
+	uint8_t *b = calloc(1, AUN_HDR_SIZE + 3 + 17 * n);
+
+	if (!m || !b) {
+		free(m);
+		free(b);
+		return;
+	}
+	b[1] = a[0];//reply port
+	b[2] = 0;//control byte 0x80, top bit not sent
+	b[AUN_HDR_SIZE] = 10;//command code, as the FS sends it
+	b[AUN_HDR_SIZE + 2] = n;
+	if (n)
+		memcpy(b + AUN_HDR_SIZE + 4, discname, 16);//drive 0
+	m->station = stnp->addr;
+	m->seq = 0;
+	m->buf = b;
+	m->len = AUN_HDR_SIZE + 3 + 17 * n;
+	_txenqueue(stnp, m);
+	bcasts_answered++;
+}
+
+static void _gotdata(void) {
+	uint8_t port;
+	uint32_t handle;
+
+	//printf("from %s\n", _addrstr(&stnp->si));
+	//for (int i = 0; i < rxlen; i++)
+	//	printf("%02x ", rxbuf[i]);
+	//printf("\n");
+
+	port = rxbuf[1];
+	handle = rxbuf[7] << 24 | rxbuf[6] << 16 | rxbuf[5] << 8 | rxbuf[4];
+
+	//printf("AUN:RX type=%02x port=%02x cb=%02x handle=%08x\n", rxbuf[0], port, rxbuf[2], handle);
+
+	switch (rxbuf[0]) {// type
+		case AUN_TYPE_UNICAST:
+			//printf("UNICAST\n");
+			if ((handle > stnp->rxhandle) || (time(0) > stnp->rxtime)) {
+				if (handle < stnp->rxhandle)
+					_cacheclear(stnp);//client restarted, its handles start again
+				if (port == SCHED_PORT && _cachecheck(handle)) {
+					stnp->rxhandle = handle;
+					stnp->rxtime = time(0) + AUN_RXTIMEOUT;
+					stnp->rxheld = 0;
+					_sendack();
+					break;//answered from the cache
+				}
+
+				struct aunmsg_t *m = _rxmsg();
+
+				if (m && ring_put(&rxring, m)) {//ACKed when it's in an RXCB
+					stnp->rxhandle = handle;
+					stnp->rxtime = time(0) + AUN_RXTIMEOUT;
+					stnp->rxheld = 1;
+					rxbuf = NULL;
+					_wake(evpipe[1], 'r');
+				} else {//no ACK, the sender will retry
+					free(m);
+					if (port == SCHED_PORT)
+						_cacheclear(stnp);
+					__atomic_fetch_add(&stnp->bufmisses, 1, __ATOMIC_RELAXED);
+					log_msg(LOGC_AUN, LOGL_WARN, "receive ring full");
+				}
+			} else {
+				stnp->duplicates++;
+				if (handle == stnp->rxhandle && !stnp->rxheld)
+					_sendack();//duplicate of last packet, send ack
+			}// else duplicate of old packet, or still waiting for an RXCB, ignore
+			break;
+		case AUN_TYPE_BROADCAST: {
+			if (rxlen == lastbcastlen && !memcmp(rxbuf, lastbcast, rxlen))
+				break;//one of ours
+			bcasts_rx++;
+			if (port == SCHED_PORT && rxlen > AUN_HDR_SIZE + 1 && rxbuf[AUN_HDR_SIZE + 1] == 14 && discname[0]) {
+				_fsdiscs();
+				break;
+			}
+			struct aunmsg_t *m = _rxmsg();//no ACK, so no retries to weed out
+
+			if (m && ring_put(&rxring, m)) {
+				rxbuf = NULL;
+				_wake(evpipe[1], 'r');
+			} else
+				free(m);
+			break;
+		}
+		case AUN_TYPE_ACK:
+			//printf("ACK RECEIVED\n");
+			if (stnp->txq && handle == stnp->txhandle) {
+				if (!stnp->txretry)
+					_rttsample(stnp);
+				_txdone(stnp, EB_RESULT_SUCCESSFUL);// ACK TO CURRENT TRANSMISSION
+			}// else not expecting an ACK
+			break;
+		case AUN_TYPE_IMMEDIATE:
+			//printf("IMM %02x : ", rxbuf[2]);//control byte
+			//for (int i = 8; i < rxlen && i < 32; i++)
+			//	printf("%02x ", rxbuf[i]);
+			//printf("\n");
+			if (rxbuf[2] == ECONET_PEEK) {//reads memory, answered by the emulator
+				struct aunmsg_t *m = _rxmsg();
+
+				if (m && ring_put(&rxring, m)) {
+					rxbuf = NULL;
+					_wake(evpipe[1], 'r');
+				} else
+					free(m);//no retries for immediates, it's lost
+			} else
+				_immediate();
+			break;
+		case AUN_TYPE_IMM_REPLY:
+		default:
+			//printf("Type?\n");
+			break;
+	}
+}
+
+static void _rximpair(void) {
+	//Pass a received packet through the impairment stage.  Duplicates
+	//are queued with no delay, so they follow the original straight away.
+	int delay[2], n = impair_packet(stnp->addr, IMPAIR_RX, delay), now = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (delay[i] || now++)
+			_delay(IMPAIR_RX, lrx, &si_other, slen, stnp->addr, rxbuf, rxlen, delay[i]);
+	}
+	if (now)
+		_gotdata();
+}
+
+static int _release(void) {
+	//Pass on delayed packets that are due.
+	//Returns ms until the next one, or -1 if none are waiting.
+	uint32_t now = tick_ms();
+
+	while (delayed && (int32_t) (now - delayed->due) >= 0) {
+		struct delayed_t *d = delayed;
+		delayed = d->next;
+
+		if (d->dir == IMPAIR_TX) {
+			_sendto(d->l, &d->si, d->alen, d->buf, d->len);
+			free(d->buf);
+		} else {
+			free(rxbuf);
+			rxbuf = d->buf;
+			rxlen = d->len;
+			lrx = d->l;
+			si_other = d->si;
+			slen = d->alen;
+			stnp = _station(d->station);
+			_gotdata();
+		}
+		free(d);
+	}
+
+	if (!delayed)
+		return -1;
+	int32_t left = delayed->due - now;
+	return (left < 0) ? 0 : left;
+}
+
+static void _recvpackets(struct listener_t *l) {
+	lrx = l;
+
+	for (;;) {
+		if (!rxbuf && !(rxbuf = malloc(AUN_RXBUFLEN)))
+			return;
+
+		slen = sizeof(si_other);
+		rxlen = recvfrom(l->sock, rxbuf, AUN_RXBUFLEN, 0, &si_other.sa, &slen);
+
+		if (rxlen == -1) {
+			if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) 
+				die("recvfrom()");
+			return;
+		}
+
+		_capture(l, &si_other, 0, rxbuf, rxlen);
+		if (rxlen < AUN_HDR_SIZE)
+			continue;
+
+		//printf("Received packet from %s length=%d\n", _addrstr(&si_other), rxlen);
+		stnp = _addrfind(&si_other);
+
+		if (!stnp) {//not mapped or seen before, derive a local station number
+			int stn = -1;
+			if (l->local) {//from the number at the end of the client's path
+				if (slen > offsetof(struct sockaddr_un, sun_path))
+					stn = _pathstn(si_other.un.sun_path);
+			} else if (l->riscos && ntohs(si_other.in.sin_port) == 32768)
+				stn = ntohl(si_other.in.sin_addr.s_addr) & 255;
+			else
+				stn = ntohs(si_other.in.sin_port) - AUN_PORT_BASE;
+
+			if (stn > 0 && stn < 255) {
+				stnp = _station(AUN_ADDR(0, stn));
+				if (stnp->alen == 0) {
+					//printf("New station\n");
+					_bindstation(stnp, &si_other, slen);
+				} else {
+					log_msg(LOGC_AUN, LOGL_WARN, "Duplicate station %d", stn);
+					stnp = NULL;
+				}
+			} else
+				log_msg(LOGC_AUN, LOGL_WARN, "Station number out of range");
+		}
+
+		if (stnp) {
+			//printf("stn=%d.%d\n", AUN_NET(stnp->addr), AUN_STN(stnp->addr));
+			stnp->via = l->out;//reply the way it came
+			stnp->rxpackets++;
+			stnp->rxbytes += rxlen;
+			stnp->lastseen = tick_ms();
+			if (stnp->addr == mystn) 
+				log_msg(LOGC_AUN, LOGL_WARN, "Duplicate station %d", stnp->addr);
+			else {
+				//printf("Station OK\n");
+				_rximpair();
+			}
+		}
+	}
+}
+
+static void _stations(void) {
+	for (struct aun_t *s = stnlist; s; s = s->next) {
+		if (s->alen)
+			printf("AUN:stn %3d.%-3d %s via %d%s srtt=%uus rttvar=%uus rto=%dms retransmits=%u timeouts=%u txqueue=%d txfailed=%u cachehits=%u\n",
+				AUN_NET(s->addr), AUN_STN(s->addr), _addrstr(&s->si),
+				s->via ? (int) (s->via - listeners) : -1, s->mapped ? " (mapped)" : "",
+				s->srtt, s->rttvar, _rto(s), s->retransmits, s->timeouts, s->txqlen, s->txfailed, s->cachehits);
+	}
+	printf("AUN:reply cache hits=%u busy=%u misses=%u skipped=%u bytes=%u\n",
+		cache_hits, cache_busy, cache_misses, cache_skipped, cache_bytes);
+	printf("AUN:broadcasts received=%u sent=%u answered=%u\n", bcasts_rx, bcasts_tx, bcasts_answered);
+	imm_stats();
+	impair_stats();
+	pcap_stats();
+	log_stats();
+	rt_stats();
+}
+
+static void _ctlreport(FILE *f, char *query) {
+	//Answer a control socket query: "json", "stations", "global" or "" for both.
+	int json = !strcmp(query, "json"), all = !*query;
+	uint32_t now = tick_ms();
+
+	if (!json && !all && strcmp(query, "stations") && strcmp(query, "global")) {
+		fprintf(f, "Queries: json, stations, global, or an empty line for both\n");
+		return;
+	}
+
+	if (json)
+		fprintf(f, "{\"global\":{");
+	if (json || all || !strcmp(query, "global"))
+		fprintf(f, json ? "\"mips\":%.3f,\"scsi_iops\":%u,\"wakeups_per_s\":%u,"
+			"\"instructions\":%llu,\"scsi_ops\":%llu,\"wakeups\":%llu},\n"
+			: "mips=%.3f scsi_iops=%u wakeups_per_s=%u instructions=%llu scsi_ops=%llu wakeups=%llu\n",
+			PUB_LOAD(pub.kips) / 1000.0, PUB_LOAD(pub.iops), PUB_LOAD(pub.wakeups_s),
+			(unsigned long long) PUB_LOAD(pub.instructions), (unsigned long long) PUB_LOAD(pub.scsiops),
+			(unsigned long long) PUB_LOAD(pub.wakeups));
+	if (json)
+		fprintf(f, "\"stations\":[");
+	if (json || all || !strcmp(query, "stations")) {
+		int first = 1;
+		for (struct aun_t *s = stnlist; s; s = s->next) {
+			if (!s->alen)
+				continue;
+			if (json) {
+				fprintf(f, "%s\n{\"net\":%d,\"stn\":%d,\"addr\":", first ? "" : ",", AUN_NET(s->addr), AUN_STN(s->addr));
+				ctl_jsonstr(f, _addrstr(&s->si));
+				fprintf(f, ",\"rx_packets\":%u,\"rx_bytes\":%llu,\"tx_packets\":%u,\"tx_bytes\":%llu,"
+					"\"duplicates\":%u,\"timeouts\":%u,\"retransmits\":%u,\"txfailed\":%u,\"bufmisses\":%u,"
+					"\"scheddrops\":%u,\"cachehits\":%u,\"srtt_us\":%u,",
+					s->rxpackets, (unsigned long long) s->rxbytes, s->txpackets, (unsigned long long) s->txbytes,
+					s->duplicates, s->timeouts, s->retransmits, s->txfailed, PUB_LOAD(s->bufmisses),
+					PUB_LOAD(s->scheddrops), s->cachehits, s->srtt);
+				if (s->rxpackets)
+					fprintf(f, "\"last_seen_ms\":%u}", now - s->lastseen);
+				else
+					fprintf(f, "\"last_seen_ms\":null}");
+			} else {
+				fprintf(f, "stn %d.%d %s rx=%u/%llu tx=%u/%llu duplicates=%u timeouts=%u retransmits=%u txfailed=%u bufmisses=%u scheddrops=%u cachehits=%u srtt=%uus",
+					AUN_NET(s->addr), AUN_STN(s->addr), _addrstr(&s->si),
+					s->rxpackets, (unsigned long long) s->rxbytes, s->txpackets, (unsigned long long) s->txbytes,
+					s->duplicates, s->timeouts, s->retransmits, s->txfailed, PUB_LOAD(s->bufmisses),
+					PUB_LOAD(s->scheddrops), s->cachehits, s->srtt);
+				if (s->rxpackets)
+					fprintf(f, " seen=%.1fs\n", (now - s->lastseen) / 1000.0);
+				else
+					fprintf(f, " seen=never\n");
+			}
+			first = 0;
+		}
+	}
+	if (json)
+		fprintf(f, "]}\n");
+}
+
+static void *_iothread(void *arg) {
+	struct pollfd pfd[AUN_MAX_LISTENERS + 1 + CTL_CLIENTS + 1];
+	char cmd[16];
+
+	rt_thread(RT_IO);
+	pfd[0].fd = cmdpipe[0];
+	pfd[0].events = POLLIN;
+	for (int i = 0; i < nlisteners; i++) {
+		pfd[i + 1].fd = listeners[i].sock;
+		pfd[i + 1].events = POLLIN;
+	}
+
+	for (;;) {
+		int wait = _txtimer(), held = _release();
+		int nctl = ctl_pollfds(&pfd[nlisteners + 1]);
+
+		if (held >= 0 && (wait < 0 || held < wait))
+			wait = held;
+
+		uint64_t start = tick_us();
+		int ready = poll(pfd, nlisteners + 1 + nctl, wait);
+		if (ready == -1 && errno != EINTR)
+			die("poll()");
+		if (!ready && wait > 0)
+			rt_wake(RT_IO, wait, start);
+
+		if (pfd[0].revents & POLLIN) {
+			int n = read(cmdpipe[0], cmd, sizeof(cmd));
+			for (int i = 0; i < n; i++) {
+				switch (cmd[i]) {
+					case 'q'://quit
+						return NULL;
+					case 's'://station table
+						_stations();
+						break;
+				}//'t' is just a wake up for the transmitter
+			}
+		}
+
+		for (int i = 0; i < nlisteners; i++)
+			if (pfd[i + 1].revents & POLLIN)
+				_recvpackets(&listeners[i]);
+
+		ctl_service(&pfd[nlisteners + 1], nctl, _ctlreport);
+		_txqueue();
+	}
+}
+
+/* Emulator thread */
+
+static void _bufmiss(struct aunmsg_t *m) {
+	struct aun_t *s = stations[m->station];
+
+	if (s)
+		__atomic_fetch_add(&s->bufmisses, 1, __ATOMIC_RELAXED);
+}
+
+static void _rxreply(struct aunmsg_t *m, uint8_t type) {
+	//Tell the I/O thread what became of a unicast packet, AUN_TYPE_ACK
+	//or AUN_TYPE_DROPPED.  It only needs the header back.
+	struct aunmsg_t *r;
+	uint8_t *b;
+
+	if (m->buf[0] != AUN_TYPE_UNICAST)
+		return;//broadcasts aren't ACKed
+	r = malloc(sizeof(struct aunmsg_t));
+	b = malloc(AUN_HDR_SIZE);
+	if (r && b) {
+		memcpy(b, m->buf, AUN_HDR_SIZE);
+		b[0] = type;
+		r->station = m->station;
+		r->seq = 0;
+		r->buf = b;
+		r->len = AUN_HDR_SIZE;
+		if (ring_put(&txring, r)) {
+			_wake(cmdpipe[1], 't');
+			return;
+		}
+	}
+	free(r);//the sender will retry
+	free(b);
+}
+
+static void _discard(struct aunmsg_t *m) {
+	_rxreply(m, AUN_TYPE_DROPPED);
+	free(m->buf);
+	free(m);
+}
+
+static void _drop(struct aunmsg_t *m) {
+	_bufmiss(m);
+	_discard(m);
+}
+
+static int _deliver(struct aunmsg_t *m) {
+	//Put a received packet into any matching open RXCB.
+	//Returns 1 if delivered, 0 if there's no matching RXCB, -1 if dropped.
+	uint8_t *hdr = m->buf;
+	struct ebuf_t *p = ebuf_rxfind(m->station, hdr[1]);
+
+	if (!p)
+		return 0;
+
+	if (m->len > (p->len + AUN_HDR_SIZE)) {
+		log_msg(LOGC_AUN, LOGL_WARN, "buffer too small");
+		_drop(m);
+		return -1;
+	}
+
+	ebuf_rxlatch(p);
+	_rxreply(m, AUN_TYPE_ACK);
+
+	//printf("ebuf %d found\n", p->index);
+	p->station = m->station;//from station
+	p->port = hdr[1];//to port
+	p->control = hdr[2] | 0x80;//control byte
+	ebuf_bind(p, m->buf, m->len);
+	p->state = EB_STATE_RECEIVED;
+	if (hdr[1] == SCHED_PORT && m->len > AUN_HDR_SIZE + 1)//reply port, function
+		fsop_begin(m->station, hdr[AUN_HDR_SIZE], hdr[AUN_HDR_SIZE + 1], m->us);
+	free(m);
+	return 1;
+}
+
+static void _dropmsg(void *p) {
+	//The scheduler's queue for the station was full or it was too old
+	struct aunmsg_t *m = p;
+	struct aun_t *s = stations[m->station];
+
+	if (s)
+		__atomic_fetch_add(&s->scheddrops, 1, __ATOMIC_RELAXED);
+	_discard(m);
+}
+
+static void _peek(struct aunmsg_t *m) {
+	//Immediate peek, read here where the emulator isn't writing memory.
+	//The reply goes back through the I/O thread as it is.
+	int len = imm_reply(m->buf, m->len, AUN_RXBUFLEN);
+
+	m->seq = 0;
+	m->len = len;
+	if (len && ring_put(&txring, m))
+		_wake(cmdpipe[1], 't');
+	else {
+		free(m->buf);
+		free(m);
+	}
+}
+
+static void _unhold(int i) {
+	pend_count--;
+	memmove(&pending[i], &pending[i + 1], (pend_count - i) * sizeof(pending[0]));
+}
+
+static void _hold(struct aunmsg_t *m) {
+	//No RXCB open for it yet, keep it until there is
+	if (pend_count == AUN_PENDING) {
+		log_msg(LOGC_AUN, LOGL_WARN, "ebuf not found");
+		_drop(pending[0]);
+		_unhold(0);
+	}
+	pending[pend_count++] = m;
+}
+
+static int _check(void) {
+	struct aunmsg_t *m;
+	uint32_t now = tick_ms();
+	for (int i = 0; i < pend_count; i++) {
+		m = pending[i];
+		if ((int32_t) (now - m->time) > AUN_RXTIMEOUT * 1000) {
+			log_msg(LOGC_AUN, LOGL_WARN, "ebuf not found");
+			_drop(m);
+			_unhold(i--);
+		} else if (_deliver(m))
+			_unhold(i--);
+	}
+
+	while ((m = ring_get(&rxring))) {
+		if (m->buf[0] == AUN_TYPE_IMMEDIATE) {
+			_peek(m);
+			continue;
+		}
+		if (m->buf[1] == SCHED_PORT && sched_put(m->station, m, m->time))
+			continue;//to the FS in turn
+		if (!_deliver(m))
+			_hold(m);
+	}
+
+	while ((m = sched_peek())) {//command port requests, fairly
+		if (!_deliver(m))
+			break;//FS isn't listening for commands
+		sched_pop();
+	}
+
+	return ebuf_ready();
+}
+
+int aun_receiver(int wait_ms) {
+	//Returns 1 if data was received, 0 if nothing arrived within wait_ms.
+	int received = _check();
+
+	if (!received && wait_ms > 0) {
+		struct pollfd pfd = {evpipe[0], POLLIN, 0};
+		char b[64];
+
+		uint64_t start = tick_us();
+		int ready = poll(&pfd, 1, wait_ms);
+
+		if (ready > 0)
+			while (read(evpipe[0], b, sizeof(b)) > 0);
+		else if (!ready)
+			rt_wake(RT_EMU, wait_ms, start);
+		received = _check();
+	}
+
+	return received;
+}
+
+static void _txstatus(unsigned seq, uint8_t status) {
+	if (txres[seq % AUN_TXRESULTS].seq == seq)//else long forgotten
+		txres[seq % AUN_TXRESULTS].status = status;
+}
+
+int aun_transmitter(unsigned *seq) {
+	//Queue the TXCB's packet.  *seq identifies it to aun_txstatus.
+	struct ebuf_t *p = ebuf_txfind();//ALWAYS ebufs[0]
+	struct aunmsg_t *m = malloc(sizeof(struct aunmsg_t));
+
+	if (!++txseq)
+		txseq = 1;//0 is for the I/O thread's own
+	*seq = txseq;
+	txres[txseq % AUN_TXRESULTS].seq = txseq;
+	txres[txseq % AUN_TXRESULTS].status = EB_STATUS_FAILED;
+
+	//printf("tx %d %d %04x %02x\n", p->index, p->state, p->station, p->port);
+	if (!m)
+		return 0;
+
+	m->station = p->station;
+	m->seq = txseq;
+	m->buf = p->buf2;
+	m->len = p->len2;
+	m->buf[0] = AUN_TYPE_UNICAST;
+	m->buf[1] = p->port;//rest of the header is done by the I/O thread
+	m->buf[2] = p->control & 0x7f;
+	ebuf_bind(p, NULL, 0);//buffer now belongs to the message
+	p->state = EB_STATE_VOID;//free for the next one
+
+	if (!ring_put(&txring, m)) {
+		free(m->buf);
+		free(m);
+		return 0;
+	}
+
+	_txstatus(txseq, EB_STATUS_PENDING);
+	_wake(cmdpipe[1], 't');
+	return 1;
+}
+
+uint8_t aun_txstatus(unsigned seq) {
+	//Result of transmission 'seq', as reported by OSBYTE 0x32
+	struct aunmsg_t *m;
+
+	while ((m = ring_get(&resring))) {
+		_txstatus(m->seq, (m->result == EB_RESULT_SUCCESSFUL) ? EB_STATUS_DONE : EB_STATUS_FAILED);
+		free(m);
+	}
+	if (txres[seq % AUN_TXRESULTS].seq != seq)
+		return EB_STATUS_DONE;//none yet, or too old to remember
+	return txres[seq % AUN_TXRESULTS].status;
+}
+
+int aun_setrto(int min_ms, int max_ms, int backoff, int attempts) {
+	//0 or less leaves a value unchanged.  0 if the bounds would cross or
+	//the backoff is too big.
+	int min = (min_ms > 0) ? min_ms : rto_min;
+	int max = (max_ms > 0) ? max_ms : rto_max;
+
+	if (min > max || backoff > AUN_RTO_BACKOFFMAX)
+		return 0;
+	rto_min = min;
+	rto_max = max;
+	if (backoff > 0)
+		rto_backoff = backoff;
+	if (attempts > 0)
+		tx_attempts = attempts;
+	return 1;
+}
+
+void aun_stations(void) {
+	_wake(cmdpipe[1], 's');//printed by the I/O thread
+}
+
+void aun_control(char *path) {
+	ctlpath = path;
+}
+
+int aun_broadcast(char *ip) {
+	//Subnet broadcast address, before aun_open.  0 if no good.
+	memset(&bcastaddr, 0, sizeof(bcastaddr));
+	if (inet_pton(AF_INET, ip, &bcastaddr.sin_addr) != 1)
+		return 0;
+	bcastaddr.sin_family = AF_INET;
+	bcastaddr.sin_port = htons(32768);
+	return 1;
+}
+
+void aun_discname(char *name) {
+	snprintf(discname, sizeof(discname), "%-16.16s", name);
+}
+
+void aun_publish(uint64_t instructions, uint64_t scsiops, uint64_t wakeups) {
+	//Emulator counters for the control socket, rates worked out about once a second.
+	uint32_t now = tick_ms(), ms = now - pubtime;
+
+	PUB_STORE(pub.instructions, instructions);
+	PUB_STORE(pub.scsiops, scsiops);
+	PUB_STORE(pub.wakeups, wakeups);
+	if (ms < 1000)
+		return;
+	if (pubtime) {
+		PUB_STORE(pub.kips, (uint32_t) ((instructions - pubinstructions) / ms));
+		PUB_STORE(pub.iops, (uint32_t) ((scsiops - pubscsiops) * 1000 / ms));
+		PUB_STORE(pub.wakeups_s, (uint32_t) ((wakeups - pubwakeups) * 1000 / ms));
+	}
+	pubtime = now;
+	pubinstructions = instructions;
+	pubscsiops = scsiops;
+	pubwakeups = wakeups;
+}
+
+int aun_loadmap(char *fname) {
+	//Each line: net.stn ip.address[:port]   eg "1.101 192.168.1.101:32768"
+	//or net.stn unix:/path for a local client.
+	//A bare station number means net 0.  '#' starts a comment.
+	char line[256], ip[128];
+	int n = 0, lineno = 0;
+	FILE *fp = fopen(fname, "r");
+
+	if (!fp) {
+		log_msg(LOGC_AUN, LOGL_ERROR, "Could not open map file '%s'", fname);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned net = 0, stn, port = 32768;
+		union aunaddr_t si;
+		socklen_t len = sizeof(si.in);
+		char *c = strchr(line, '#');
+
+		lineno++;
+		if (c)
+			*c = 0;
+		if (sscanf(line, "%u.%u %127s", &net, &stn, ip) != 3) {
+			net = 0;
+			if (sscanf(line, "%u %127s", &stn, ip) != 2)
+				continue;//blank or comment
+		}
+
+		if (!strncmp(ip, "unix:", 5))
+			len = _unixaddr(&si, ip + 5);
+		else {
+			c = strchr(ip, ':');
+			if (c) {
+				*c++ = 0;
+				port = atoi(c);
+			}
+
+			memset(&si, 0, sizeof(si));
+			si.in.sin_family = AF_INET;
+			si.in.sin_port = htons(port);
+			if (port > 0xffff || inet_pton(AF_INET, ip, &si.in.sin_addr) != 1)
+				len = 0;
+		}
+
+		if (net > 127 || stn < 1 || stn > 254 || !len) {
+			log_msg(LOGC_AUN, LOGL_WARN, "%s:%d: bad map entry", fname, lineno);
+			continue;
+		}
+
+		struct aun_t *s = _station(AUN_ADDR(net, stn));
+		if (s->alen || _addrfind(&si)) {
+			log_msg(LOGC_AUN, LOGL_WARN, "%s:%d: duplicate map entry", fname, lineno);
+			continue;
+		}
+		s->mapped = 1;
+		_bindstation(s, &si, len);
+		n++;
+	}
+
+	fclose(fp);
+	log_msg(LOGC_AUN, LOGL_INFO, "%d stations mapped from '%s'", n, fname);
+	return n;
+}
+
+
+static void _pipe(int *fds) {
+	if (pipe(fds) == -1)
+		die("pipe");
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+}
+
+int aun_open(uint16_t stn, int buffers, char **listen, int nlisten) {
+	//printf("aun_open stn=%d\n", stn);
+
+	mystn = stn;	// remember my station number
+	ebuf_open(buffers);
+	sched_open(_dropmsg);
+	for (int i = 0; i < nlisten; i++)
+		_opensock(listen[i]);
+
+	for (struct aun_t *s = stnlist; s; s = s->next) {
+		//mapped stations start off with the first listener in the right
+		//mode, until we hear from them
+		int local = (s->si.sa.sa_family == AF_UNIX);
+		int riscos = !local && ntohs(s->si.in.sin_port) == 32768;
+
+		for (int i = nlisteners - 1; i >= 0; i--) {
+			if (listeners[i].local != local)
+				continue;//wrong kind of socket, it can't get there
+			if (!s->via || listeners[i].riscos == riscos)
+				s->via = &listeners[i];
+		}
+		if (!s->via)
+			log_msg(LOGC_AUN, LOGL_WARN, "No %s listener for %s", local ? "unix" : "IP", _addrstr(&s->si));
+	}
+	if (bcastaddr.sin_family)
+		_openbcast();
+
+	_pipe(evpipe);
+	_pipe(cmdpipe);
+	if (!ring_init(&rxring, AUN_RING_SIZE) || !ring_init(&txring, AUN_RING_SIZE)
+			|| !ring_init(&resring, AUN_RING_SIZE * 4))
+		die("ring_init");
+	if (ctlpath)
+		ctl_open(ctlpath);
+
+	if (pthread_create(&iothread, NULL, _iothread, NULL))
+		die("pthread_create");
+	return 0;
+}
+
+int aun_close(void) {
+	//printf("aun_close\n");
+	struct aunmsg_t *m;
+	_wake(cmdpipe[1], 'q');
+	pthread_join(iothread, NULL);
+	impair_stats();
+	ctl_close();
+
+	while (delayed) {
+		struct delayed_t *d = delayed;
+		delayed = d->next;
+		free(d->buf);
+		free(d);
+	}
+
+	for (int i = 0; i < nlisteners; i++) {
+		close(listeners[i].sock);
+		if (listeners[i].local)
+			unlink(listeners[i].si.un.sun_path);
+	}
+	close(evpipe[0]);
+	close(evpipe[1]);
+	close(cmdpipe[0]);
+	close(cmdpipe[1]);
+
+	while (pend_count--) {
+		free(pending[pend_count]->buf);
+		free(pending[pend_count]);
+	}
+	for (struct aun_t *s = stnlist; s; s = s->next) {
+		while (s->txq) {
+			struct aunmsg_t *m = s->txq;
+			s->txq = m->next;
+			free(m->buf);
+			free(m);
+		}
+	}
+	while ((m = ring_get(&txring)) || (m = ring_get(&resring)) || (m = ring_get(&rxring))) {
+		free(m->buf);
+		free(m);
+	}
+	sched_close();
+	ring_free(&rxring);
+	ring_free(&txring);
+	ring_free(&resring);
+	ebuf_close();
+	return 0;
+}
@@ -2,28 +2,57 @@
 /* aun.h                  */
 /* (c) 2021 Martin Mather */
 
-#define AUN_MAX_STATIONS	255
-#define AUN_MAX_BUFFERS	5
+#define AUN_MAX_STATIONS	0x10000	// (net << 8) | stn
+#define AUN_HASH_SIZE	256	// ip:port to station buckets, power of 2
+#define AUN_PENDING	16	// received packets held until an RXCB is opened
+#define AUN_RING_SIZE	64	// packets between the emulator and I/O threads
+#define AUN_TXQUEUE	16	// transmissions queued per station
+#define AUN_TXRESULTS	64	// recent transmission results kept for OSBYTE 0x32
+#define AUN_MAX_LISTENERS	8	// sockets served at once
+#define AUN_CACHE_MAXREPLY	1024	// largest reply kept for retransmitted requests
+#define AUN_CACHE_BYTES	(256*1024)	// total kept for all stations
+#define AUN_MAX_BUFFERS	64	// default number of ebufs (RXCBs + 1)
 #define AUN_PORT_BASE	10000
 
 #define AUN_RXBUFLEN	2048	// max length of receive buffer
 #define AUN_RXTIMEOUT	5		// seconds
 
+#define AUN_RTO_INIT	1000	// ms, until the first RTT sample
+#define AUN_RTO_MIN	20		// ms
+#define AUN_RTO_MAX	4000	// ms
+#define AUN_RTO_BACKOFF	2		// multiplier per retry
+#define AUN_RTO_BACKOFFMAX	16	// largest -b
+#define AUN_TX_RETRIES	10		// number of tx attempts
+
 #define AUN_HDR_SIZE	8
+#define AUN_BROADCAST	0xffff	// station
 
-//#define AUN_TYPE_BROADCAST	1
+#define AUN_TYPE_BROADCAST	1
 #define AUN_TYPE_UNICAST	2
 #define AUN_TYPE_ACK		3
 //#define AUN_TYPE_NACK		4
 #define AUN_TYPE_IMMEDIATE	5
 #define AUN_TYPE_IMM_REPLY	6
 
+#define ECONET_PEEK		1
 #define ECONET_MACHINEPEEK	8
 
+#define AUN_ADDR(net, stn)	(((net) << 8) | (stn))
+#define AUN_NET(a)	((a) >> 8)
+#define AUN_STN(a)	((a) & 0xff)
+
 #include <netinet/in.h>
 
-int aun_open(uint16_t stn, in_addr_t listen_addr);
+int aun_loadmap(char *fname);
+int aun_open(uint16_t stn, int buffers, char **listen, int nlisten);
 int aun_close(void);
-int aun_receiver(int ackwait);
-int aun_transmitter(int retry);
+int aun_receiver(int wait_ms);
+int aun_transmitter(unsigned *seq);
+uint8_t aun_txstatus(unsigned seq);
+int aun_setrto(int min_ms, int max_ms, int backoff, int attempts);
+void aun_stations(void);
+void aun_control(char *path);
+int aun_broadcast(char *ip);
+void aun_discname(char *name);
+void aun_publish(uint64_t instructions, uint64_t scsiops, uint64_t wakeups);
 
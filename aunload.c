@@ -0,0 +1,547 @@
+/* File Server Emulator   */
+/* aunload.c              */
+/* (c) 2021 Martin Mather */
+
+/* Load generator.  Pretends to be a number of stations on this machine, */
+/* each on its own BeebEm style port, which log on to the file server    */
+/* and then catalogue, read and write files in a given mix for a while.  */
+/* Reports throughput, latency percentiles and retransmissions.          */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "aun.h"
+#include "sched.h"
+#include "tick.h"
+
+#define LOAD_REPLYPORT	0x90
+#define LOAD_DATAPORT	0x91	// getbytes data, putbytes acks
+#define LOAD_ACKWAIT	500	// ms, before resending a packet
+#define LOAD_REPLYWAIT	10000	// ms, for the file server to answer
+#define LOAD_STASH	8	// packets received while waiting for something else
+#define LOAD_MAXSIZE	(64*1024)
+#define LOAD_CATENTRIES	20	// per examine request, more won't fit in a reply
+
+#define OP_LOGIN	0
+#define OP_CAT	1
+#define OP_READ	2
+#define OP_WRITE	3
+#define OPS	4
+
+static const char *opnames[OPS] = {"login", "cat", "read", "write"};
+
+struct pkt_t {
+	uint8_t port;
+	int len;
+	uint8_t buf[AUN_RXBUFLEN];
+};
+
+struct opstat_t {
+	uint32_t count, errors;
+	uint32_t *us;//latency samples
+	uint32_t nus, maxus;
+	uint64_t bytes;
+};
+
+static struct station_t {
+	int stn, sock;
+	pthread_t thread;
+	uint32_t txhandle, rxhandle;
+	uint8_t urd, csd, lib;
+	unsigned seed;
+	struct pkt_t stash[LOAD_STASH];
+	int nstash;
+	uint32_t retransmits, timeouts;
+	struct opstat_t op[OPS];
+} *stations;
+
+static struct sockaddr_in server;
+static char *user = "WELCOME", *readfile = "WELCOME";
+static int weights[OPS] = {0, 1, 4, 2}, nstations = 4, first = 101, size = 1024, ops = 0;
+static int seconds = 10;
+static uint64_t deadline;//us
+
+static void _send(struct station_t *s, uint8_t type, uint8_t port, uint8_t cb, uint32_t handle, uint8_t *data, int len) {
+	uint8_t buf[AUN_RXBUFLEN];
+
+	buf[0] = type;
+	buf[1] = port;
+	buf[2] = cb;
+	buf[3] = 0;
+	buf[4] = handle;
+	buf[5] = handle >> 8;
+	buf[6] = handle >> 16;
+	buf[7] = handle >> 24;
+	memcpy(buf + AUN_HDR_SIZE, data, len);
+	if (sendto(s->sock, buf, AUN_HDR_SIZE + len, 0, (struct sockaddr *) &server, sizeof(server)) == -1)
+		perror("sendto");
+}
+
+static int _recv(struct station_t *s, int wait_ms, struct pkt_t *p, uint32_t *ack) {
+	//Wait for a packet.  Data is ACKed and duplicates dropped.
+	//Returns 1 for data in p, 2 for an ACK (handle in ack), 0 on timeout.
+	uint8_t buf[AUN_RXBUFLEN];
+	uint64_t until = tick_us() + wait_ms * 1000ull;
+
+	for (;;) {
+		int64_t left = (int64_t) (until - tick_us()) / 1000;
+		struct pollfd pfd = {s->sock, POLLIN, 0};
+
+		if (left < 0 || poll(&pfd, 1, left) <= 0)
+			return 0;
+
+		int len = recv(s->sock, buf, sizeof(buf), 0);
+		if (len < AUN_HDR_SIZE)
+			continue;
+		uint32_t handle = buf[4] | buf[5] << 8 | buf[6] << 16 | (uint32_t) buf[7] << 24;
+
+		if (buf[0] == AUN_TYPE_ACK) {
+			*ack = handle;
+			return 2;
+		}
+		if (buf[0] != AUN_TYPE_UNICAST)
+			continue;
+		_send(s, AUN_TYPE_ACK, buf[1], buf[2], handle, NULL, 0);
+		if (handle == s->rxhandle)
+			continue;//we've had it, the ACK was lost
+		s->rxhandle = handle;
+		p->port = buf[1];
+		p->len = len - AUN_HDR_SIZE;
+		memcpy(p->buf, buf + AUN_HDR_SIZE, p->len);
+		return 1;
+	}
+}
+
+static int _xmit(struct station_t *s, uint8_t port, uint8_t *data, int len) {
+	//Send data and wait for the ACK, resending as needed.  0 if it failed.
+	struct pkt_t p;
+	uint32_t ack;
+
+	s->txhandle += 4;
+	for (int attempt = 0; attempt < AUN_TX_RETRIES; attempt++) {
+		if (attempt)
+			s->retransmits++;
+		_send(s, AUN_TYPE_UNICAST, port, 0x80, s->txhandle, data, len);
+
+		uint64_t until = tick_us() + LOAD_ACKWAIT * 1000;
+		int64_t left;
+		while ((left = (int64_t) (until - tick_us()) / 1000) >= 0) {
+			int r = _recv(s, left, &p, &ack);
+			if (r == 2 && ack == s->txhandle)
+				return 1;
+			if (r == 1 && s->nstash < LOAD_STASH)//answer came before the ACK
+				s->stash[s->nstash++] = p;
+			if (!r)
+				break;
+		}
+	}
+	s->timeouts++;
+	return 0;
+}
+
+static int _wait(struct station_t *s, uint8_t port, uint8_t port2, struct pkt_t *p) {
+	//Wait for data to either port.  0 if nothing came.
+	uint32_t ack;
+
+	for (int i = 0; i < s->nstash; i++) {
+		if (s->stash[i].port == port || s->stash[i].port == port2) {
+			*p = s->stash[i];
+			memmove(&s->stash[i], &s->stash[i + 1], (--s->nstash - i) * sizeof(struct pkt_t));
+			return 1;
+		}
+	}
+
+	uint64_t until = tick_us() + LOAD_REPLYWAIT * 1000ull;
+	int64_t left;
+	while ((left = (int64_t) (until - tick_us()) / 1000) >= 0) {
+		if (_recv(s, left, p, &ack) == 1) {
+			if (p->port == port || p->port == port2)
+				return 1;
+			if (s->nstash < LOAD_STASH)
+				s->stash[s->nstash++] = *p;
+		}
+	}
+	s->timeouts++;
+	return 0;
+}
+
+static int _request(struct station_t *s, uint8_t fn, uint8_t urd, uint8_t *args, int len, struct pkt_t *reply) {
+	//A command to the file server, returns its result code or -1.
+	uint8_t buf[AUN_RXBUFLEN];
+
+	buf[0] = LOAD_REPLYPORT;
+	buf[1] = fn;
+	buf[2] = urd;
+	buf[3] = s->csd;
+	buf[4] = s->lib;
+	memcpy(buf + 5, args, len);
+	if (!_xmit(s, SCHED_PORT, buf, 5 + len) || !_wait(s, LOAD_REPLYPORT, LOAD_REPLYPORT, reply))
+		return -1;
+	return reply->len >= 2 ? reply->buf[1] : -1;
+}
+
+static void _put24(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+}
+
+static int _open(struct station_t *s, char *name, int readonly) {
+	//Returns a handle, or 0.
+	uint8_t args[32];
+	struct pkt_t r;
+	int len = snprintf((char *) args + 2, sizeof(args) - 2, "%s\r", name);
+
+	if (len > (int) sizeof(args) - 3) {//cut short, keep the CR
+		len = sizeof(args) - 3;
+		args[1 + len] = '\r';
+	}
+	args[0] = readonly;//must exist
+	args[1] = readonly;
+	if (_request(s, 6, s->urd, args, 2 + len, &r) != 0 || r.len < 3)
+		return 0;
+	return r.buf[2];
+}
+
+static void _close(struct station_t *s, int handle) {
+	uint8_t h = handle;
+	struct pkt_t r;
+
+	_request(s, 7, s->urd, &h, 1, &r);
+}
+
+static int _login(struct station_t *s) {
+	uint8_t args[64];
+	struct pkt_t r;
+	int len = snprintf((char *) args, sizeof(args), "I AM %s\r", user);
+
+	if (len > (int) sizeof(args) - 1) {//cut short, keep the CR
+		len = sizeof(args) - 1;
+		args[len - 1] = '\r';
+	}
+	if (_request(s, 0, 0, args, len, &r) != 0 || r.len < 5)
+		return -1;
+	s->urd = r.buf[2];
+	s->csd = r.buf[3];
+	s->lib = r.buf[4];
+	return 0;
+}
+
+static int _cat(struct station_t *s) {
+	uint8_t args[] = {1, 0, LOAD_CATENTRIES, '\r'};//text, from the first entry
+	struct pkt_t r;
+
+	if (_request(s, 3, s->urd, args, sizeof(args), &r) != 0)
+		return -1;
+	return r.len;
+}
+
+static int _read(struct station_t *s) {
+	//Get bytes, returns the number read or -1.
+	uint8_t args[8];
+	struct pkt_t r;
+	int h = _open(s, readfile, 1), got = 0, rc;
+
+	if (!h)
+		return -1;
+	args[0] = h;
+	args[1] = 0;//at the given offset
+	_put24(args + 2, size);
+	_put24(args + 5, 0);
+	rc = _request(s, 10, LOAD_DATAPORT, args, sizeof(args), &r);
+	while (rc == 0 && _wait(s, LOAD_DATAPORT, LOAD_REPLYPORT, &r)) {
+		if (r.port == LOAD_REPLYPORT) {//the end
+			rc = (r.len >= 6) ? r.buf[1] : -1;
+			got = (r.len >= 6) ? r.buf[3] | r.buf[4] << 8 | r.buf[5] << 16 : 0;
+			break;
+		}
+	}
+	_close(s, h);
+	return (rc == 0) ? got : -1;
+}
+
+static int _write(struct station_t *s) {
+	//Put bytes to a file of our own, returns the number written or -1.
+	uint8_t args[8], data[LOAD_MAXSIZE];
+	char name[16];
+	struct pkt_t r;
+	int h, rc, sent = 0;
+
+	snprintf(name, sizeof(name), "LOAD%d", s->stn);
+	if (!(h = _open(s, name, 0)))
+		return -1;
+	for (int i = 0; i < size; i++)
+		data[i] = rand_r(&s->seed);
+	args[0] = h;
+	args[1] = 0;
+	_put24(args + 2, size);
+	_put24(args + 5, 0);
+	rc = _request(s, 11, LOAD_DATAPORT, args, sizeof(args), &r);
+	if (rc == 0 && r.len >= 5) {
+		uint8_t dataport = r.buf[2];
+		int block = r.buf[3] | r.buf[4] << 8;
+
+		rc = -1;
+		while (block > 0 && sent < size) {
+			int n = (size - sent < block) ? size - sent : block;
+			if (n > AUN_RXBUFLEN - AUN_HDR_SIZE)
+				n = AUN_RXBUFLEN - AUN_HDR_SIZE;//the server's block size is up to it
+			if (!_xmit(s, dataport, data + sent, n))
+				break;
+			sent += n;
+			if (!_wait(s, LOAD_DATAPORT, LOAD_REPLYPORT, &r))
+				break;
+			if (r.port == LOAD_REPLYPORT) {//all done
+				rc = (r.len >= 2) ? r.buf[1] : -1;
+				break;
+			}
+		}
+	}
+	_close(s, h);
+	return (rc == 0) ? sent : -1;
+}
+
+static void _record(struct opstat_t *o, uint64_t start, int result) {
+	uint32_t us = tick_us() - start;
+
+	o->count++;
+	if (result < 0) {
+		o->errors++;
+		return;
+	}
+	o->bytes += result;
+	if (!(o->nus & 1023)) {
+		uint32_t *p = realloc(o->us, (o->nus + 1024) * sizeof(uint32_t));
+		if (!p)
+			return;
+		o->us = p;
+	}
+	o->us[o->nus++] = us;
+	if (us > o->maxus)
+		o->maxus = us;
+}
+
+static int _pick(struct station_t *s) {
+	int total = 0, r;
+
+	for (int i = 1; i < OPS; i++)
+		total += weights[i];
+	r = rand_r(&s->seed) % total;
+	for (int i = 1; i < OPS; i++) {
+		if (r < weights[i])
+			return i;
+		r -= weights[i];
+	}
+	return OP_CAT;
+}
+
+static void *_station(void *arg) {
+	struct station_t *s = arg;
+	uint64_t start = tick_us();
+	int r = _login(s);
+
+	_record(&s->op[OP_LOGIN], start, r);
+	if (r < 0)
+		return NULL;
+
+	for (int n = 0; (!ops || n < ops) && (ops || tick_us() < deadline); n++) {
+		int op = _pick(s);
+
+		start = tick_us();
+		switch (op) {
+			case OP_CAT:
+				r = _cat(s);
+				break;
+			case OP_READ:
+				r = _read(s);
+				break;
+			default:
+				r = _write(s);
+				break;
+		}
+		_record(&s->op[op], start, r);
+	}
+	return NULL;
+}
+
+static int _cmp(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void _report(double secs) {
+	uint32_t retransmits = 0, timeouts = 0, done = 0;
+	uint64_t bytes = 0;
+
+	printf("%d stations for %.1fs\n", nstations, secs);
+	printf("%-6s %8s %6s %8s %9s %9s %9s %9s %10s\n", "op", "count", "errors", "ops/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "KB/s");
+	for (int op = 0; op < OPS; op++) {
+		struct opstat_t all = {0};
+
+		for (int i = 0; i < nstations; i++) {
+			struct opstat_t *o = &stations[i].op[op];
+			uint32_t *p = realloc(all.us, (all.nus + o->nus + 1) * sizeof(uint32_t));
+			if (!p)
+				break;
+			all.us = p;
+			memcpy(all.us + all.nus, o->us, o->nus * sizeof(uint32_t));
+			all.nus += o->nus;
+			all.count += o->count;
+			all.errors += o->errors;
+			all.bytes += o->bytes;
+			if (o->maxus > all.maxus)
+				all.maxus = o->maxus;
+		}
+		if (!all.count) {
+			free(all.us);
+			continue;
+		}
+		qsort(all.us, all.nus, sizeof(uint32_t), _cmp);
+#define PC(n) (all.nus ? all.us[(all.nus - 1) * (n) / 100] / 1000.0 : 0)
+		printf("%-6s %8u %6u %8.1f %9.2f %9.2f %9.2f %9.2f %10.1f\n", opnames[op], all.count, all.errors,
+			all.nus / secs, PC(50), PC(90), PC(99), all.maxus / 1000.0, all.bytes / secs / 1024);
+		if (op != OP_LOGIN) {
+			done += all.nus;
+			bytes += all.bytes;
+		}
+		free(all.us);
+	}
+	for (int i = 0; i < nstations; i++) {
+		retransmits += stations[i].retransmits;
+		timeouts += stations[i].timeouts;
+	}
+	printf("total %u ops, %.1f ops/s, %.1f KB/s, retransmits=%u timeouts=%u\n",
+		done, done / secs, bytes / secs / 1024, retransmits, timeouts);
+}
+
+static void _mix(char *spec) {
+	//eg "cat=1,read=4,write=2"
+	char *item;
+
+	memset(weights, 0, sizeof(weights));
+	for (item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+		char *val = strchr(item, '=');
+		int op;
+
+		for (op = 1; op < OPS; op++)
+			if (!strncmp(item, opnames[op], val ? (size_t) (val - item) : strlen(item)))
+				break;
+		if (op == OPS) {
+			fprintf(stderr, "Unknown operation '%s'\n", item);
+			exit(EXIT_FAILURE);
+		}
+		weights[op] = val ? atoi(val + 1) : 1;
+	}
+	if (weights[OP_CAT] + weights[OP_READ] + weights[OP_WRITE] <= 0) {
+		fprintf(stderr, "Nothing to do\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	char *host = "127.0.0.1";
+	int port = AUN_PORT_BASE + 254, opt;
+
+	while ((opt = getopt(argc, argv, "h:p:n:f:t:c:u:m:z:r:")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				nstations = atoi(optarg);
+				break;
+			case 'f':
+				first = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'c':
+				ops = atoi(optarg);
+				break;
+			case 'u':
+				user = optarg;
+				break;
+			case 'm':
+				_mix(optarg);
+				break;
+			case 'z':
+				size = atoi(optarg);
+				break;
+			case 'r':
+				readfile = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-h server_ip] [-p server_port] [-n stations] [-f first_stn] [-t seconds] [-c ops_per_station] [-u user] [-m cat=1,read=4,write=2] [-z bytes] [-r file_to_read]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (nstations < 1 || first < 1 || first + nstations > 255 || size < 1 || size > LOAD_MAXSIZE) {
+		fprintf(stderr, "Stations must be 1 to 254, sizes 1 to %d\n", LOAD_MAXSIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+		fprintf(stderr, "Bad server address '%s'\n", host);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(stations = calloc(nstations, sizeof(struct station_t)))) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nstations; i++) {
+		struct station_t *s = &stations[i];
+		struct sockaddr_in si;
+
+		s->stn = first + i;
+		s->seed = s->stn;
+		s->txhandle = (uint32_t) tick_us() & ~3u;//above any the server had from a previous run
+		memset(&si, 0, sizeof(si));
+		si.sin_family = AF_INET;
+		si.sin_port = htons(AUN_PORT_BASE + s->stn);
+		si.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((s->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1
+				|| bind(s->sock, (struct sockaddr *) &si, sizeof(si)) == -1) {
+			fprintf(stderr, "Station %d: ", s->stn);
+			perror("socket");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uint64_t start = tick_us();
+	deadline = start + seconds * 1000000ull;
+	for (int i = 0; i < nstations; i++)
+		if (pthread_create(&stations[i].thread, NULL, _station, &stations[i]))
+			perror("pthread_create");
+	for (int i = 0; i < nstations; i++)
+		pthread_join(stations[i].thread, NULL);
+
+	_report((tick_us() - start) / 1e6);
+
+	for (int i = 0; i < nstations; i++) {
+		close(stations[i].sock);
+		for (int op = 0; op < OPS; op++)
+			free(stations[i].op[op].us);
+	}
+	free(stations);
+	return 0;
+}
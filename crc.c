@@ -0,0 +1,95 @@
+/* File Server Emulator   */
+/* crc.c                  */
+/* (c) 2021 Martin Mather */
+
+/* CRC32C (Castagnoli), as used for the disc sector checksums.  Uses    */
+/* the SSE4.2 crc32 instruction when the CPU has it, or on ARM the CRC  */
+/* instructions when built for them (-march=armv8-a+crc), otherwise a   */
+/* table.  A sector takes about 70ns with SSE4.2, 1us from the table.   */
+
+#include <string.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_ARM
+#endif
+
+#define POLY	0x82f63b78	// reversed
+
+static uint32_t table[256];
+static uint32_t (*impl)(uint32_t crc, const uint8_t *p, size_t len);
+static const char *implname = "table";
+
+static uint32_t _table(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t _sse42(uint32_t crc, const uint8_t *p, size_t len) {
+	uint64_t c = crc, v;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+#ifdef CRC_ARM
+static uint32_t _arm(uint32_t crc, const uint8_t *p, size_t len) {
+	uint64_t v;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+static void _init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+		table[i] = c;
+	}
+	impl = _table;
+#ifdef CRC_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		impl = _sse42;
+		implname = "sse4.2";
+	}
+#endif
+#ifdef CRC_ARM
+	impl = _arm;
+	implname = "armv8";
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len) {
+	if (!impl)
+		_init();
+	return ~impl(~0u, buf, len);
+}
+
+const char *crc32c_impl(void) {
+	if (!impl)
+		_init();
+	return implname;
+}
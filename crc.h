@@ -0,0 +1,19 @@
+/* File Server Emulator   */
+/* crc.h                  */
+/* (c) 2021 Martin Mather */
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(const void *buf, size_t len);
+const char *crc32c_impl(void);//which instructions are in use
+
+//image.crc starts with this, then the sum of each sector in turn.  The
+//sums are only believed if they were left clean with an image of the
+//size and modification time recorded.
+#define CRCMAGIC	0x43524346	// "FCRC"
+
+struct crchead_t {
+	uint32_t magic, clean;
+	int64_t size, sec, nsec;//the image's, when the sums were left clean
+};
@@ -0,0 +1,207 @@
+/* File Server Emulator   */
+/* ctl.c                  */
+/* (c) 2021 Martin Mather */
+
+/* A local control socket for reading live counters.  A client connects */
+/* to the Unix domain stream socket, sends one line (eg "json" or       */
+/* "stations") and gets the report back before the socket is closed.   */
+/* It's served from the I/O thread's poll loop, never blocking on a     */
+/* client, so the emulator isn't held up.                               */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "ctl.h"
+
+static struct client_t {
+	int sock;//-1 if free
+	char query[CTL_QUERYLEN];
+	int qlen;
+	char *out;//report being sent
+	size_t outlen, outpos;
+	unsigned age;
+} clients[CTL_CLIENTS];
+
+static int lsock = -1;
+static char *lpath;
+static unsigned accepted;
+
+int ctl_open(char *path) {
+	struct sockaddr_un su;
+
+	for (int i = 0; i < CTL_CLIENTS; i++)
+		clients[i].sock = -1;
+
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(su.sun_path)) {
+		printf("CTL:Socket path too long '%s'\n", path);
+		return 0;
+	}
+	strcpy(su.sun_path, path);
+	unlink(path);//left over from last time
+
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+			|| bind(lsock, (struct sockaddr *) &su, sizeof(su)) == -1
+			|| listen(lsock, CTL_CLIENTS) == -1) {
+		perror("CTL:socket");
+		if (lsock != -1)
+			close(lsock);
+		lsock = -1;
+		return 0;
+	}
+	fcntl(lsock, F_SETFL, O_NONBLOCK);
+	lpath = path;
+	printf("CTL:Listening on %s\n", path);
+	return 1;
+}
+
+static void _drop(struct client_t *c) {
+	close(c->sock);
+	c->sock = -1;
+	free(c->out);
+	c->out = NULL;
+}
+
+int ctl_pollfds(struct pollfd *pfd) {
+	//Fill in what to wait for, returns the number of entries used.
+	int n = 0;
+
+	if (lsock == -1)
+		return 0;
+
+	pfd[n].fd = lsock;
+	pfd[n++].events = POLLIN;
+	for (int i = 0; i < CTL_CLIENTS; i++) {
+		if (clients[i].sock != -1) {
+			pfd[n].fd = clients[i].sock;
+			pfd[n++].events = clients[i].out ? POLLOUT : POLLIN;
+		}
+	}
+	return n;
+}
+
+static void _accept(void) {
+	struct client_t *c = NULL;
+	int sock = accept(lsock, NULL, NULL);
+
+	if (sock == -1)
+		return;
+	for (int i = 0; i < CTL_CLIENTS; i++) {
+		if (clients[i].sock == -1) {
+			c = &clients[i];
+			break;
+		}
+		if (!c || clients[i].age < c->age)
+			c = &clients[i];
+	}
+	if (c->sock != -1)
+		_drop(c);//make room
+
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	c->sock = sock;
+	c->qlen = 0;
+	c->age = ++accepted;
+}
+
+static void _read(struct client_t *c, void (*report)(FILE *f, char *query)) {
+	int n = read(c->sock, c->query + c->qlen, CTL_QUERYLEN - 1 - c->qlen);
+	char *eol;
+	FILE *f;
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			_drop(c);
+		return;
+	}
+	if (n == 0 && !c->qlen) {
+		_drop(c);
+		return;
+	}
+	c->qlen += n;
+	c->query[c->qlen] = 0;
+	if (!(eol = strpbrk(c->query, "\r\n")) && n && c->qlen < CTL_QUERYLEN - 1)
+		return;//not a whole line yet, and more may come
+	if (eol)
+		*eol = 0;
+
+	if (!(f = open_memstream(&c->out, &c->outlen))) {
+		_drop(c);
+		return;
+	}
+	report(f, c->query);
+	fclose(f);
+	c->outpos = 0;
+}
+
+static void _write(struct client_t *c) {
+	ssize_t n = send(c->sock, c->out + c->outpos, c->outlen - c->outpos, MSG_NOSIGNAL);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			_drop(c);
+		return;
+	}
+	c->outpos += n;
+	if (c->outpos == c->outlen)
+		_drop(c);//all sent
+}
+
+void ctl_service(struct pollfd *pfd, int n, void (*report)(FILE *f, char *query)) {
+	//Handle whatever poll() found on the entries from ctl_pollfds().
+	for (int i = 0; i < n; i++) {
+		if (!pfd[i].revents)
+			continue;
+		if (pfd[i].fd == lsock) {
+			_accept();
+			continue;
+		}
+		for (int j = 0; j < CTL_CLIENTS; j++) {
+			struct client_t *c = &clients[j];
+			if (c->sock != pfd[i].fd)
+				continue;
+			if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+				_drop(c);
+			else if (c->out)
+				_write(c);
+			else
+				_read(c, report);
+			break;
+		}
+	}
+}
+
+void ctl_jsonstr(FILE *f, const char *s) {
+	//A JSON string, for the reports here and the boot benchmark's
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((uint8_t) *s < ' ')
+			fprintf(f, "\\u%04x", (uint8_t) *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+void ctl_close(void) {
+	if (lsock == -1)
+		return;
+	for (int i = 0; i < CTL_CLIENTS; i++)
+		if (clients[i].sock != -1)
+			_drop(&clients[i]);
+	close(lsock);
+	unlink(lpath);
+	lsock = -1;
+}
@@ -0,0 +1,15 @@
+/* File Server Emulator   */
+/* ctl.h                  */
+/* (c) 2021 Martin Mather */
+
+#include <stdio.h>
+#include <poll.h>
+
+#define CTL_CLIENTS	4	// served at once, the oldest is dropped for a new one
+#define CTL_QUERYLEN	64
+
+int ctl_open(char *path);
+int ctl_pollfds(struct pollfd *pfd);
+void ctl_service(struct pollfd *pfd, int n, void (*report)(FILE *f, char *query));
+void ctl_jsonstr(FILE *f, const char *s);
+void ctl_close(void);
@@ -0,0 +1,765 @@
+/* File Server Emulator   */
+/* disc.c                 */
+/* (c) 2021 Martin Mather */
+
+/* The SCSI disc image.  In WAL mode writes are held in memory and      */
+/* appended to a journal (image.wal) in groups; once a group and its    */
+/* commit record are synced it is written to the image.  A crash can    */
+/* lose the last uncommitted group but never leaves a write half done,  */
+/* because the committed groups are replayed into the image at start    */
+/* up.  The journal is emptied after the image is synced (checkpoint).  */
+/* Reads see writes still waiting for their commit.  A group ends when  */
+/* the FS replies to a request, or when its oldest write has waited the */
+/* commit time or the group is full.                                    */
+/*                                                                      */
+/* A backup is a copy of the image as it was when asked for, made by a  */
+/* thread at a limited rate while the FS carries on.  Any sector the FS */
+/* overwrites before the thread gets to it is copied out first.         */
+/*                                                                      */
+/* The image is locked while open, l3disc won't touch a locked image.   */
+/*                                                                      */
+/* With checksums on, image.crc holds a CRC32C of each sector.  It is   */
+/* updated whenever a write reaches the image and checked on every      */
+/* read, so a sector the disc has silently changed is reported to the   */
+/* FS as a read error instead of being believed.  The sums are marked   */
+/* suspect while the image is open and remade at start up unless they   */
+/* were left clean with the image as it is now.  A backup takes a copy  */
+/* of them, so the two can be restored together.                        */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "disc.h"
+#include "tick.h"
+#include "rt.h"
+#include "crc.h"
+#include "log.h"
+
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+#define BACKUP_CHUNK	256	// sectors the thread copies at a time
+
+#define JMAGIC	0x4c415746	// "FWAL", a write
+#define JCOMMIT	0x4d4d4f43	// "COMM", end of a group
+
+struct jrec_t {//on disc, followed by len bytes for a write
+	uint32_t magic, group, sec, len, sum;
+};
+
+static struct pending_t {
+	uint32_t sec;
+	int len;
+	uint8_t *data;
+} pending[DISC_BATCH];
+
+static int mode = DISC_OFF, commitms = DISC_COMMIT_MS;
+static int fd = -1, jfd = -1;
+static char jname[512], imgname[512];
+static int npending, pendbytes;
+static uint32_t group, oldest;//oldest pending write, ms
+static off_t jsize;
+static struct {
+	uint64_t writes, commits, syncs, replayed;
+	uint64_t commit_us, max_commit_us;
+} stats;
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int running, joinable, hurry;
+	int failed;//a copy went wrong, the backup is abandoned
+	int fd, kbs;
+	char name[512], tmp[520];
+	uint8_t *copied;//bitmap, sectors already in the backup
+	uint32_t *sums, nsums;//the checksums as they were at the start
+	uint32_t sectors;
+	uint64_t cow, streamed;//sectors
+	uint32_t start;//ms
+} bk = {.lock = PTHREAD_MUTEX_INITIALIZER, .kbs = DISC_BACKUP_KBS};
+
+static struct {
+	int want;//1 on, 0 off, -1 only if image.crc is there already
+	int fd;
+	char name[520];
+	uint32_t *crc, sectors;
+	uint64_t checked, bad;
+} sums = {.want = -1, .fd = -1};
+
+static struct {
+	int code;
+	uint32_t sec;
+} lasterr;
+
+static uint32_t _sum(const uint8_t *p, int len, uint32_t h) {
+	//FNV-1a
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static int _writeall(int f, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(f, p, len);
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+#define SUMOFF(s) ((off_t) sizeof(struct crchead_t) + (off_t) (s) * sizeof(uint32_t))
+
+#define COPIED(s) (bk.copied[(s) >> 3] & (1 << ((s) & 7)))
+#define SETCOPIED(s) bk.copied[(s) >> 3] |= 1 << ((s) & 7)
+
+static int _backupcopy(uint32_t sec, uint32_t n, uint8_t *buf) {
+	//Copy the sectors from sec not yet in the backup, lock held.
+	//0 if it failed, the backup is stopped and marked failed.
+	uint32_t i = 0;
+
+	n = sec + n > bk.sectors ? bk.sectors - sec : n;
+	while (i < n) {
+		uint32_t run;
+
+		for (; i < n && COPIED(sec + i); i++)
+			;
+		for (run = 0; i + run < n && !COPIED(sec + i + run); run++)
+			;
+		if (run) {
+			off_t off = (off_t) (sec + i) * DISC_SECSIZE;
+			ssize_t got = pread(fd, buf, run * DISC_SECSIZE, off);//short at the end of the image
+
+			if (got < 0 || (got > 0 && pwrite(bk.fd, buf, got, off) != got)) {
+				bk.failed = 1;
+				STORE(bk.running, 0);
+				return 0;
+			}
+			for (; run; run--, i++)
+				SETCOPIED(sec + i);
+		}
+	}
+	return 1;
+}
+
+static void _cow(uint32_t sec, int len) {
+	//About to overwrite, save what was there if the backup still needs it.
+	static uint8_t buf[BACKUP_CHUNK * DISC_SECSIZE];
+	uint32_t n = (len + DISC_SECSIZE - 1) / DISC_SECSIZE;
+
+	if (!LOAD(bk.running))
+		return;
+	pthread_mutex_lock(&bk.lock);
+	if (bk.running && sec < bk.sectors) {
+		for (uint32_t i = sec; i < sec + n && i < bk.sectors; i++)
+			if (!COPIED(i))
+				bk.cow++;
+		for (uint32_t i = 0; i < n && !bk.failed; i += BACKUP_CHUNK)
+			if (sec + i < bk.sectors)
+				_backupcopy(sec + i, n - i < BACKUP_CHUNK ? n - i : BACKUP_CHUNK, buf);
+	}
+	pthread_mutex_unlock(&bk.lock);
+}
+
+static int _sumstamp(int f, int img, int clean) {
+	//The header of a checksum file, clean if its sums are all right for
+	//img as it is now.  0 once it's durable.
+	struct crchead_t h = {.magic = CRCMAGIC, .clean = clean};
+	struct stat st;
+
+	if (clean) {
+		if (fsync(img) || fstat(img, &st) || fdatasync(f))
+			return -1;
+		h.size = st.st_size;
+		h.sec = st.st_mtim.tv_sec;
+		h.nsec = st.st_mtim.tv_nsec;
+	}
+	if (pwrite(f, &h, sizeof(h), 0) != (ssize_t) sizeof(h) || fdatasync(f))
+		return -1;
+	return 0;
+}
+
+static int _sumgrow(uint32_t sectors) {
+	//Room for sums up to sectors, a hole in the image reads as zeros.
+	static const uint8_t zero[DISC_SECSIZE];
+	uint32_t *c;
+
+	if (sectors <= sums.sectors)
+		return 1;
+	if (!(c = realloc(sums.crc, sectors * sizeof(*c))))
+		return 0;
+	sums.crc = c;
+	while (sums.sectors < sectors)
+		c[sums.sectors++] = crc32c(zero, DISC_SECSIZE);
+	return 1;
+}
+
+static void _sumwrite(uint32_t sec, const uint8_t *buf, int len) {
+	//The sums of sectors just written to the image.
+	uint8_t part[DISC_SECSIZE];
+	uint32_t n = (len + DISC_SECSIZE - 1) / DISC_SECSIZE;
+
+	if (sums.fd < 0 || !_sumgrow(sec + n))
+		return;
+	for (uint32_t i = 0; i < n; i++, buf += DISC_SECSIZE, len -= DISC_SECSIZE) {
+		if (len < DISC_SECSIZE) {//the rest of the sector is whatever was there
+			memset(part, 0, sizeof(part));
+			pread(fd, part, sizeof(part), (off_t) (sec + i) * DISC_SECSIZE);
+			buf = part;
+		}
+		sums.crc[sec + i] = crc32c(buf, DISC_SECSIZE);
+	}
+	pwrite(sums.fd, sums.crc + sec, n * sizeof(*sums.crc), SUMOFF(sec));
+}
+
+static int _replaced(uint32_t sec) {
+	//A write waiting for its commit covers all of the sector.
+	for (int i = 0; i < npending; i++)
+		if (pending[i].sec <= sec && pending[i].sec + (uint32_t) pending[i].len / DISC_SECSIZE > sec)
+			return 1;
+	return 0;
+}
+
+static int _sumcheck(uint32_t sec, const uint8_t *buf, int len) {
+	//Returns the bytes up to the first sector that doesn't match its sum.
+	for (int i = 0; i + DISC_SECSIZE <= len && sec < sums.sectors; i += DISC_SECSIZE, sec++) {
+		sums.checked++;
+		if (crc32c(buf + i, DISC_SECSIZE) != sums.crc[sec] && !_replaced(sec)) {
+			sums.bad++;
+			log_msg(LOGC_DISC, LOGL_ERROR, "Sector %06x doesn't match its checksum", sec);
+			return i;
+		}
+	}
+	return len;
+}
+
+static void _sumopen(char *path, const struct stat *img) {
+	//Loads image.crc, remaking the sums it hasn't got or can't vouch for.
+	//Until disc_close marks them clean again a crash leaves them suspect,
+	//as a write can reach the image without its sum or the other way round.
+	uint32_t sectors = img->st_size / DISC_SECSIZE;
+	uint8_t buf[DISC_SECSIZE];
+	struct crchead_t h;
+	struct stat st;
+	uint32_t have = 0;
+
+	snprintf(sums.name, sizeof(sums.name), "%s.crc", path);
+	if (!sums.want) {
+		unlink(sums.name);
+		return;
+	}
+	if ((sums.fd = open(sums.name, O_RDWR | (sums.want > 0 ? O_CREAT : 0), 0644)) < 0) {
+		if (sums.want > 0)
+			log_msg(LOGC_DISC, LOGL_WARN, "Couldn't open checksums '%s'", sums.name);
+		return;
+	}
+	if (fstat(sums.fd, &st) == 0 && st.st_size > 0) {
+		if (pread(sums.fd, &h, sizeof(h), 0) == (ssize_t) sizeof(h) && h.magic == CRCMAGIC && h.clean
+			&& h.size == img->st_size && h.sec == img->st_mtim.tv_sec && h.nsec == img->st_mtim.tv_nsec)
+			have = (st.st_size - sizeof(h)) / sizeof(*sums.crc);
+		else//a crash, or an image put back from a backup
+			log_msg(LOGC_DISC, LOGL_WARN, "Checksums '%s' aren't of the image as it is, remaking them", sums.name);
+	}
+	have = have < sectors ? have : sectors;
+	if (!(sums.crc = malloc((sectors ? sectors : 1) * sizeof(*sums.crc)))
+		|| pread(sums.fd, sums.crc, have * sizeof(*sums.crc), SUMOFF(0)) != (ssize_t) (have * sizeof(*sums.crc))) {
+		log_msg(LOGC_DISC, LOGL_WARN, "Couldn't read checksums '%s'", sums.name);
+		close(sums.fd);
+		sums.fd = -1;
+		return;
+	}
+	sums.sectors = sectors;
+	for (uint32_t s = have; s < sectors; s++) {
+		memset(buf, 0, sizeof(buf));
+		pread(fd, buf, sizeof(buf), (off_t) s * DISC_SECSIZE);
+		sums.crc[s] = crc32c(buf, DISC_SECSIZE);
+	}
+	if (have < sectors) {
+		pwrite(sums.fd, sums.crc + have, (sectors - have) * sizeof(*sums.crc), SUMOFF(have));
+		log_msg(LOGC_DISC, LOGL_INFO, "Checksummed %u sectors (%s)", sectors - have, crc32c_impl());
+	}
+	//suspect from here, before anything is written
+	if (_sumstamp(sums.fd, fd, 0)) {
+		log_msg(LOGC_DISC, LOGL_WARN, "Couldn't write checksums '%s'", sums.name);
+		close(sums.fd);
+		sums.fd = -1;
+	}
+}
+
+static int _apply(uint32_t sec, const uint8_t *buf, int len) {
+	int n;
+
+	_cow(sec, len);
+	if ((n = pwrite(fd, buf, len, (off_t) sec * DISC_SECSIZE)) > 0)
+		_sumwrite(sec, buf, n);
+	return n;
+}
+
+static void _sync(void) {
+	//The image, and the sums that go with it.
+	fdatasync(fd);
+	if (sums.fd >= 0)
+		fdatasync(sums.fd);
+	stats.syncs++;
+}
+
+static void _checkpoint(void) {
+	//Everything in the journal is in the image, make that durable and start again.
+	_sync();
+	if (ftruncate(jfd, 0) == 0) {
+		lseek(jfd, 0, SEEK_SET);
+		fdatasync(jfd);
+		jsize = 0;
+	}
+}
+
+static void _commit(void) {
+	struct jrec_t r;
+	uint32_t sum = 0;
+	uint64_t t = tick_us();
+	int ok = 1;
+
+	if (!npending)
+		return;
+
+	group++;
+	for (int i = 0; i < npending && ok; i++) {
+		r.magic = JMAGIC;
+		r.group = group;
+		r.sec = pending[i].sec;
+		r.len = pending[i].len;
+		r.sum = _sum(pending[i].data, pending[i].len, 2166136261u);
+		sum = _sum((uint8_t *) &r.sum, sizeof(r.sum), sum);
+		ok = _writeall(jfd, &r, sizeof(r)) && _writeall(jfd, pending[i].data, pending[i].len);
+		jsize += sizeof(r) + pending[i].len;
+	}
+	r.magic = JCOMMIT;
+	r.group = group;
+	r.sec = 0;
+	r.len = npending;
+	r.sum = sum;
+	if (ok)
+		ok = _writeall(jfd, &r, sizeof(r));
+	jsize += sizeof(r);
+	if (ok && fdatasync(jfd))
+		ok = 0;
+	if (!ok)
+		log_msg(LOGC_DISC, LOGL_WARN, "Journal write failed, writing through");
+
+	//now it's safe to update the image
+	for (int i = 0; i < npending; i++) {
+		_apply(pending[i].sec, pending[i].data, pending[i].len);
+		free(pending[i].data);
+	}
+	npending = pendbytes = 0;
+	if (!ok)
+		_sync();
+
+	stats.commits++;
+	t = tick_us() - t;
+	stats.commit_us += t;
+	if (t > stats.max_commit_us)
+		stats.max_commit_us = t;
+
+	if (jsize >= DISC_JOURNALMAX || !ok)
+		_checkpoint();
+}
+
+static void _replay(void) {
+	//Write the committed groups in the journal into the image.
+	struct jrec_t r;
+	off_t pos = 0, start = 0;
+	uint32_t sum = 0;
+	int groups = 0;
+	uint8_t *buf = NULL;
+
+	while (pread(jfd, &r, sizeof(r), pos) == sizeof(r)) {
+		if (r.magic == JCOMMIT) {
+			if (r.sum != sum)
+				break;
+			//good group, from start to here
+			for (off_t p = start; p < pos; p += sizeof(r) + r.len) {
+				pread(jfd, &r, sizeof(r), p);
+				if ((buf = realloc(buf, r.len)) && pread(jfd, buf, r.len, p + sizeof(r)) == r.len)
+					_apply(r.sec, buf, r.len);
+			}
+			groups++;
+			pos += sizeof(r);
+			start = pos;
+			sum = 0;
+		} else if (r.magic == JMAGIC && r.len <= DISC_BATCHBYTES) {
+			uint8_t *d = malloc(r.len);
+			int good = d && pread(jfd, d, r.len, pos + sizeof(r)) == r.len
+				&& _sum(d, r.len, 2166136261u) == r.sum;
+
+			free(d);
+			if (!good)
+				break;//torn, the crash was before this group's commit
+			sum = _sum((uint8_t *) &r.sum, sizeof(r.sum), sum);
+			pos += sizeof(r) + r.len;
+		} else
+			break;
+	}
+	free(buf);
+
+	if (pos) {
+		log_msg(LOGC_DISC, LOGL_INFO, "Replayed %d groups from '%s'%s", groups, jname, start < pos ? ", dropped a torn one" : "");
+		stats.replayed = groups;
+	}
+	_checkpoint();
+}
+
+static int _backupsums(char *tmp) {
+	//The sums taken when the backup started go beside it, so the two can
+	//be put back together.  0 once they're durable.
+	int f, bad;
+
+	if ((f = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	bad = pwrite(f, bk.sums, bk.nsums * sizeof(*bk.sums), SUMOFF(0)) != (ssize_t) (bk.nsums * sizeof(*bk.sums))
+		|| _sumstamp(f, bk.fd, 1);
+	return close(f) || bad ? -1 : 0;
+}
+
+static void *_backup(void *arg) {
+	//Copy the rest of the image, no faster than bk.kbs unless hurried.
+	static uint8_t buf[BACKUP_CHUNK * DISC_SECSIZE];
+	char crcname[530], crctmp[540];
+	uint64_t t0 = tick_us();
+
+	rt_thread(RT_BACKGROUND);
+	for (uint32_t sec = 0; sec < bk.sectors; sec += BACKUP_CHUNK) {
+		int ok;
+
+		pthread_mutex_lock(&bk.lock);
+		ok = !bk.failed && _backupcopy(sec, BACKUP_CHUNK, buf);
+		pthread_mutex_unlock(&bk.lock);
+		if (!ok)
+			break;
+		STORE(bk.streamed, sec + BACKUP_CHUNK < bk.sectors ? sec + BACKUP_CHUNK : bk.sectors);
+
+		//ahead of the rate? wait
+		uint64_t due = LOAD(bk.streamed) * DISC_SECSIZE * 1000000ull / (bk.kbs * 1024ull);
+		uint64_t now = tick_us() - t0;
+		if (!LOAD(bk.hurry) && due > now) {
+			struct timespec ts = {(due - now) / 1000000, (due - now) % 1000000 * 1000};
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	pthread_mutex_lock(&bk.lock);
+	STORE(bk.running, 0);
+	pthread_mutex_unlock(&bk.lock);
+	snprintf(crcname, sizeof(crcname), "%s.crc", bk.name);
+	snprintf(crctmp, sizeof(crctmp), "%s.tmp", crcname);
+	if (fdatasync(bk.fd))
+		bk.failed = 1;
+	if (!bk.failed && bk.nsums && _backupsums(crctmp))
+		bk.failed = 1;
+	if (close(bk.fd))
+		bk.failed = 1;
+	if (!bk.nsums)//any there are an older backup's
+		unlink(crcname);
+	if (bk.failed) {
+		unlink(bk.tmp);
+		unlink(crctmp);
+		log_msg(LOGC_DISC, LOGL_ERROR, "Backup to '%s' failed, abandoned", bk.name);
+	} else if (rename(bk.tmp, bk.name) || (bk.nsums && rename(crctmp, crcname)))
+		log_msg(LOGC_DISC, LOGL_ERROR, "Couldn't rename backup to '%s'", bk.name);
+	else
+		log_msg(LOGC_DISC, LOGL_INFO, "Backup '%s' done, %u sectors, %llu copied before being overwritten, %ums",
+			bk.name, bk.sectors, (unsigned long long) bk.cow, tick_ms() - bk.start);
+	free(bk.copied);
+	bk.copied = NULL;
+	free(bk.sums);
+	bk.sums = NULL;
+	return NULL;
+}
+
+int disc_name(char *name) {
+	//The L3 disc name, from the "AFS0" block that sector 0 points to.
+	uint8_t buf[DISC_SECSIZE];
+	uint32_t sec;
+
+	if (disc_read(0, buf, DISC_SECSIZE) != DISC_SECSIZE)
+		return 0;
+	sec = buf[0xf6] | (buf[0xf7] << 8) | (buf[0xf8] << 16);
+	if (disc_read(sec, buf, DISC_SECSIZE) != DISC_SECSIZE || memcmp(buf, "AFS0", 4))
+		return 0;
+	memcpy(name, buf + 4, 16);
+	name[16] = 0;
+	return 1;
+}
+
+int disc_backup(char *spec) {
+	//Start a backup to file[:KB/s], or the image name + ".bak".  0 if one's running.
+	struct stat st;
+	char *c;
+
+	if (LOAD(bk.running)) {
+		log_msg(LOGC_DISC, LOGL_WARN, "Backup already running, %u of %u sectors", (uint32_t) LOAD(bk.streamed), bk.sectors);
+		return 0;
+	}
+	if (bk.joinable) {
+		pthread_join(bk.thread, NULL);
+		bk.joinable = 0;
+	}
+
+	if (spec) {
+		snprintf(bk.name, sizeof(bk.name), "%s", spec);
+		if ((c = strrchr(bk.name, ':')) && c[1] >= '0' && c[1] <= '9') {
+			*c++ = 0;
+			if (atoi(c) > 0)
+				bk.kbs = atoi(c);
+		}
+	} else
+		snprintf(bk.name, sizeof(bk.name), "%s.bak", imgname);
+	snprintf(bk.tmp, sizeof(bk.tmp), "%s.tmp", bk.name);
+
+	_commit();//the backup is of everything the FS has written so far
+	if (fstat(fd, &st) || (bk.fd = open(bk.tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		log_msg(LOGC_DISC, LOGL_ERROR, "Couldn't write backup '%s'", bk.tmp);
+		return 0;
+	}
+	bk.sectors = (st.st_size + DISC_SECSIZE - 1) / DISC_SECSIZE;
+	if (!(bk.copied = calloc(1, bk.sectors / 8 + 1))) {
+		close(bk.fd);
+		return 0;
+	}
+	//the sums are of the image as it is now, the backup's starting point
+	bk.nsums = sums.fd < 0 ? 0 : sums.sectors < bk.sectors ? sums.sectors : bk.sectors;
+	if (bk.nsums && !(bk.sums = malloc(bk.nsums * sizeof(*bk.sums)))) {
+		close(bk.fd);
+		free(bk.copied);
+		bk.copied = NULL;
+		return 0;
+	}
+	if (bk.nsums)
+		memcpy(bk.sums, sums.crc, bk.nsums * sizeof(*bk.sums));
+	bk.cow = bk.streamed = 0;
+	bk.failed = 0;
+	bk.start = tick_ms();
+	STORE(bk.hurry, 0);
+	STORE(bk.running, 1);
+	if (pthread_create(&bk.thread, NULL, _backup, NULL)) {
+		STORE(bk.running, 0);
+		close(bk.fd);
+		free(bk.copied);
+		bk.copied = NULL;
+		free(bk.sums);
+		bk.sums = NULL;
+		return 0;
+	}
+	bk.joinable = 1;
+	log_msg(LOGC_DISC, LOGL_INFO, "Backup to '%s' started, %u sectors at %d KB/s", bk.name, bk.sectors, bk.kbs);
+	return 1;
+}
+
+int disc_mode(char *spec) {
+	//"off", "sync" or "wal[:ms]".  0 if no good.
+	if (!strcmp(spec, "off"))
+		mode = DISC_OFF;
+	else if (!strcmp(spec, "sync"))
+		mode = DISC_SYNC;
+	else if (!strncmp(spec, "wal", 3) && (!spec[3] || spec[3] == ':')) {
+		mode = DISC_WAL;
+		if (spec[3] && (commitms = atoi(spec + 4)) < 0)
+			return 0;
+	} else
+		return 0;
+	return 1;
+}
+
+int disc_crc(char *spec) {
+	//on or off, returns 0 if the spec is bad.
+	if (!strcmp(spec, "on"))
+		sums.want = 1;
+	else if (!strcmp(spec, "off"))
+		sums.want = 0;
+	else
+		return 0;
+	return 1;
+}
+
+long disc_open(char *path) {
+	//Returns the size in sectors, -1 if it can't be opened.
+	struct stat st;
+	struct flock lk = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+
+	if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st))
+		return -1;
+	//l3disc won't touch an image locked by a running server
+	if (fcntl(fd, F_SETLK, &lk)) {
+		log_msg(LOGC_DISC, LOGL_WARN, "'%s' is in use", path);
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	snprintf(imgname, sizeof(imgname), "%s", path);
+	_sumopen(path, &st);
+
+	//a journal left by a crash is replayed whatever the mode now
+	snprintf(jname, sizeof(jname), "%s.wal", path);
+	if ((jfd = open(jname, O_RDWR | (mode == DISC_WAL ? O_CREAT : 0), 0644)) >= 0) {
+		_replay();
+		if (mode != DISC_WAL) {
+			close(jfd);
+			jfd = -1;
+			unlink(jname);
+		}
+	} else if (mode == DISC_WAL) {
+		log_msg(LOGC_DISC, LOGL_WARN, "Couldn't open journal '%s', writing through", jname);
+		mode = DISC_SYNC;
+	}
+	return st.st_size / DISC_SECSIZE;
+}
+
+int disc_read(uint32_t sec, uint8_t *buf, int len) {
+	//Returns the bytes read.
+	off_t off = (off_t) sec * DISC_SECSIZE;
+	int n = pread(fd, buf, len, off), good;
+
+	lasterr.code = 0;
+	if (n < 0) {
+		lasterr.code = DISC_EREAD;
+		lasterr.sec = sec;
+		return 0;
+	}
+	if (sums.fd >= 0 && (good = _sumcheck(sec, buf, n)) < n) {
+		lasterr.code = DISC_EREAD;
+		lasterr.sec = sec + good / DISC_SECSIZE;
+		return good;
+	}
+	for (int i = 0; i < npending; i++) {//newer than the image, in order
+		off_t poff = (off_t) pending[i].sec * DISC_SECSIZE;
+		off_t s = poff > off ? poff : off;
+		off_t e = poff + pending[i].len < off + len ? poff + pending[i].len : off + len;
+
+		if (s < e) {
+			memcpy(buf + (s - off), pending[i].data + (s - poff), e - s);
+			if (e - off > n)
+				n = e - off;
+		}
+	}
+	return n;
+}
+
+int disc_write(uint32_t sec, uint8_t *buf, int len) {
+	//Returns the bytes written, which in WAL mode may not be committed yet.
+	uint8_t *data;
+	int n;
+
+	stats.writes++;
+	lasterr.code = 0;
+	if (mode == DISC_WAL) {
+		if (npending == DISC_BATCH || pendbytes + len > DISC_BATCHBYTES)
+			_commit();
+		if (len <= DISC_BATCHBYTES && (data = malloc(len))) {
+			memcpy(data, buf, len);
+			pending[npending].data = data;
+			pending[npending].sec = sec;
+			pending[npending].len = len;
+			if (!npending)
+				oldest = tick_ms();
+			npending++;
+			pendbytes += len;
+			return len;
+		}
+		//too big for a group, or no room to hold it: written through once
+		//the journal is empty, so a replay can't put older data over it
+		_commit();
+		if (jsize)
+			_checkpoint();
+	}
+
+	n = _apply(sec, buf, len);
+	if (mode != DISC_OFF)
+		_sync();
+	if (n < len) {
+		lasterr.code = DISC_EWRITE;
+		lasterr.sec = sec + (n < 0 ? 0 : n) / DISC_SECSIZE;
+	}
+	return n < 0 ? 0 : n;
+}
+
+int disc_error(uint32_t *sec) {
+	//What went wrong with the last read or write, 0 if it was fine.
+	*sec = lasterr.sec;
+	return lasterr.code;
+}
+
+void disc_poll(void) {
+	//Group commit, once the oldest waiting write is due.
+	if (npending && (int32_t) (tick_ms() - oldest) >= commitms)
+		_commit();
+}
+
+int disc_due(void) {
+	//ms until disc_poll has a group to commit, -1 if nothing's waiting.
+	int32_t left;
+
+	if (!npending)
+		return -1;
+	left = commitms - (int32_t) (tick_ms() - oldest);
+	return left < 0 ? 0 : left;
+}
+
+void disc_commit(void) {
+	//The FS is replying, so what it has written so far goes in one group.
+	_commit();
+}
+
+void disc_stats(FILE *f) {
+	static const char *modes[] = {"off", "wal", "sync"};
+
+	fprintf(f, "DISC:mode=%s writes=%llu commits=%llu syncs=%llu", modes[mode],
+		(unsigned long long) stats.writes, (unsigned long long) stats.commits, (unsigned long long) stats.syncs);
+	if (stats.commits)
+		fprintf(f, " writes/commit=%.1f commit=%lluus (max %lluus)", (double) stats.writes / stats.commits,
+			(unsigned long long) (stats.commit_us / stats.commits), (unsigned long long) stats.max_commit_us);
+	if (mode == DISC_WAL)
+		fprintf(f, " journal=%lld replayed=%llu", (long long) jsize, (unsigned long long) stats.replayed);
+	if (sums.fd >= 0)
+		fprintf(f, " crc32c=%s checked=%llu bad=%llu", crc32c_impl(),
+			(unsigned long long) sums.checked, (unsigned long long) sums.bad);
+	if (LOAD(bk.running))
+		fprintf(f, " backup=%u/%u cow=%llu", (uint32_t) LOAD(bk.streamed), bk.sectors, (unsigned long long) bk.cow);
+	fprintf(f, "\n");
+}
+
+void disc_close(void) {
+	if (fd < 0)
+		return;
+	if (bk.joinable) {//let it finish, flat out
+		STORE(bk.hurry, 1);
+		pthread_join(bk.thread, NULL);
+		bk.joinable = 0;
+	}
+	if (jfd >= 0) {
+		_commit();
+		_checkpoint();
+		close(jfd);
+		jfd = -1;
+		unlink(jname);
+	}
+	if (sums.fd >= 0) {
+		if (_sumstamp(sums.fd, fd, 1))
+			log_msg(LOGC_DISC, LOGL_WARN, "Couldn't mark checksums '%s' clean, they'll be remade", sums.name);
+		close(sums.fd);
+		sums.fd = -1;
+	}
+	close(fd);
+	fd = -1;
+}
@@ -0,0 +1,34 @@
+/* File Server Emulator   */
+/* disc.h                 */
+/* (c) 2021 Martin Mather */
+
+#include <stdint.h>
+
+#define DISC_SECSIZE	0x100
+
+#define DISC_OFF	0	// written straight to the image, the OS flushes it when it likes
+#define DISC_WAL	1	// journalled, group committed
+#define DISC_SYNC	2	// written through, synced every write
+
+#define DISC_COMMIT_MS	20	// default longest a write waits for its group commit
+#define DISC_BATCH	128	// most writes in one commit
+#define DISC_BATCHBYTES	(1024 * 1024)
+#define DISC_JOURNALMAX	(8 * 1024 * 1024)	// journal size that forces a checkpoint
+#define DISC_BACKUP_KBS	4096	// default backup rate
+
+#define DISC_EREAD	0x11	// unrecoverable read error, as a SCSI drive reports it
+#define DISC_EWRITE	0x03	// write fault
+
+int disc_mode(char *spec);
+int disc_crc(char *spec);
+long disc_open(char *path);
+int disc_read(uint32_t sec, uint8_t *buf, int len);
+int disc_write(uint32_t sec, uint8_t *buf, int len);
+int disc_name(char *name);
+int disc_error(uint32_t *sec);
+int disc_backup(char *spec);
+void disc_poll(void);
+int disc_due(void);
+void disc_commit(void);
+void disc_stats(FILE *f);
+void disc_close(void);
@@ -2,9 +2,13 @@
 /* ebuf.c                 */
 /* (c) 2021 Martin Mather */
 
+/* ebufs[0] is for transmitting, the rest are receive control blocks.  */
+/* Open RXCBs are indexed by (station, port), so a received packet is  */
+/* matched against all of them in O(1), wildcards included.            */
+
 #include <stdio.h>
 #include <stdint.h>
-#include <malloc.h>
+#include <stdlib.h>
 
 #include "ebuf.h"
 #include "aun.h"
@@ -13,22 +17,73 @@ static int ebuf_count;
 static struct ebuf_t *ebufs = NULL;
 static int elisten = 0;
 
+static struct ebuf_t *rxindex[EB_HASH_SIZE];
+static uint8_t *freelist;//stack of free RXCB numbers
+static int freecount;
+
+static unsigned _hash(uint16_t stn, int port) {
+	return (stn * 31u + port) & (EB_HASH_SIZE - 1);
+}
+
+static void _index(struct ebuf_t *p) {//add to the tail, oldest matches first
+	struct ebuf_t **h = &rxindex[_hash(p->station, p->port)];
+
+	while (*h)
+		h = &(*h)->hnext;
+	p->hnext = NULL;
+	*h = p;
+}
+
+static void _unindex(struct ebuf_t *p) {
+	struct ebuf_t **h = &rxindex[_hash(p->station, p->port)];
+
+	while (*h && *h != p)
+		h = &(*h)->hnext;
+	if (*h)
+		*h = p->hnext;
+	p->hnext = NULL;
+}
+
+static struct ebuf_t *_match(uint16_t stn, int port) {
+	struct ebuf_t *p = rxindex[_hash(stn, port)];
+
+	while (p && (p->station != stn || p->port != port))
+		p = p->hnext;
+	return p;
+}
+
 void ebuf_listen(int x) {
 	//printf("ebuf_listen X = %d\n", x);
 	elisten = x;
 }
+
+int ebuf_ready(void) {//has the block being listened on received something?
+	if (elisten && elisten < ebuf_count && ebufs[elisten].state == EB_STATE_RECEIVED) {
+		elisten = 0;
+		return 1;
+	}
+	return 0;
+}
  
 void ebuf_open(int max_buffers) {
 	//printf("ebuf_open %d\n", max_buffers);
+	if (max_buffers > EB_MAX_BUFFERS)
+		max_buffers = EB_MAX_BUFFERS;//RXCB numbers are one byte
 	ebuf_count = max_buffers;
 	ebufs = malloc(ebuf_count * sizeof(struct ebuf_t));
+	freelist = malloc(ebuf_count);
 
 	struct ebuf_t *p = ebufs;
 	for (int i = 0; i < ebuf_count; i++, p++) {
 		p->index = i;
 		p->state = EB_STATE_VOID;
 		p->buf2 = NULL;
+		p->hnext = NULL;
 	}
+
+	freecount = 0;
+	for (int i = ebuf_count - 1; i > 0; i--)
+		freelist[freecount++] = i;//lowest number on top
 }
 
 void ebuf_close(void) {
@@ -41,6 +96,7 @@ void ebuf_close(void) {
 	}
 
 	free(ebufs);
+	free(freelist);
 }
 
 void ebuf_bind(struct ebuf_t *p, uint8_t *buf, int len) {
@@ -63,42 +119,52 @@ uint8_t *ebuf_malloc(struct ebuf_t *p, int len) {
 }
 
 void ebuf_kill(struct ebuf_t *p) {
-	if (p) {
+	if (p && p->state != EB_STATE_VOID) {
 		//printf("Kill %d\n", p->index);
+		if (p->state == EB_STATE_LISTENING)
+			_unindex(p);
 		p->state = EB_STATE_VOID;
 		free(p->buf2);
 		p->buf2 = NULL;
+		if (p->index)
+			freelist[freecount++] = p->index;
 	}
 }
 
 struct ebuf_t *ebuf_new() {
-	struct ebuf_t *p = &ebufs[1];
-	for (int i = 1; i < ebuf_count; i++, p++) {
-		if (p->state == EB_STATE_VOID)
-			return p;
-	}
-	return NULL;
+	if (!freecount)
+		return NULL;
+	return &ebufs[freelist[--freecount]];
 }
 
-struct ebuf_t *ebuf_x(int x) {//assume x is valid
-	return &ebufs[x];
+void ebuf_rxopen(struct ebuf_t *p) {//start listening
+	p->state = EB_STATE_LISTENING;
+	_index(p);
 }
 
-struct ebuf_t *ebuf_rxfind(uint16_t stn, int port) {
-	
-	if (elisten) {
-		struct ebuf_t *p = &ebufs[elisten];
-
-		if ((p->port == 0 || p->port == port) && (p->station == 0 || p->station == stn))
-		{
-			//printf("FOUND listen=%d block=%d\n", elisten, p->index);
-			elisten = 0;
-			return p;
+struct ebuf_t *ebuf_x(int x) {
+	return (x > 0 && x < ebuf_count) ? &ebufs[x] : NULL;
+}
 
-		}
-	}
+struct ebuf_t *ebuf_rxfind(uint16_t stn, int port) {
+	//Any open block will do, most specific first.  It stays in the index
+	//until ebuf_rxlatch, so it can still be found if it isn't used.
+	struct ebuf_t *p = _match(stn, port);
+
+	if (!p)
+		p = _match(stn, 0);
+	if (!p)
+		p = _match(0, port);
+	if (!p)
+		p = _match(0, 0);
+	return p;
+}
 
-	return NULL;
+void ebuf_rxlatch(struct ebuf_t *p) {
+	//Taken out of the index, it stays latched as received until the FS
+	//reads it.  Before its station and port are overwritten.
+	//printf("FOUND listen=%d block=%d\n", elisten, p->index);
+	_unindex(p);
 }
 
 struct ebuf_t *ebuf_txfind() {
@@ -106,7 +172,7 @@ struct ebuf_t *ebuf_txfind() {
 }
 
 void ebuf_print(struct ebuf_t *p) {
-	printf("ebuf index=%d state=%d stn=%x port=%x len=%x buf2=%x len2=%x\n", p->index, p->state, p->station, p->port, p->len, p->buf2, p->len2);
+	printf("ebuf index=%d state=%d stn=%x port=%x len=%x buf2=%p len2=%x\n", p->index, p->state, p->station, p->port, p->len, p->buf2, p->len2);
 }
 
 void ebuf_list() {
@@ -114,5 +180,5 @@ void ebuf_list() {
 	for (int i = 0; i < ebuf_count; i++, p++)
 		if (p->state != EB_STATE_VOID)
 			ebuf_print(p);
+	printf("ebuf %d of %d free\n", freecount, ebuf_count - 1);
 }
-
@@ -11,10 +11,18 @@
 #define EB_STATE_SENDING2	6
 #define EB_STATE_SENT		7
 
+#define EB_MAX_BUFFERS	256	// RXCB numbers are one byte, 0 is the transmit buffer
+#define EB_HASH_SIZE	64	// (station, port) index buckets, power of 2
+
 #define EB_RESULT_SUCCESSFUL	0
 #define EB_RESULT_TIMEDOUT	1
 #define EB_RESULT_OTHER		2
 
+//transmit status returned by OSBYTE 0x32
+#define EB_STATUS_DONE		0x00
+#define EB_STATUS_FAILED	0x40
+#define EB_STATUS_PENDING	0x80
+
 struct ebuf_t {
 	int index;
 	int state;
@@ -26,15 +34,20 @@ struct ebuf_t {
 
 	uint8_t control;//Econet TX control byte
 	uint32_t addr;//in Beeb memory
+
+	struct ebuf_t *hnext;//(station, port) index chain
 };
 
 
 void ebuf_listen(int x);
+int ebuf_ready(void);
 void ebuf_open(int max_buffers);
 void ebuf_close(void);
 struct ebuf_t *ebuf_new(void);
+void ebuf_rxopen(struct ebuf_t *p);
 struct ebuf_t *ebuf_x(int x);
 struct ebuf_t *ebuf_rxfind(uint16_t stn, int port);
+void ebuf_rxlatch(struct ebuf_t *p);
 struct ebuf_t *ebuf_txfind(void);
 void ebuf_bind(struct ebuf_t *p, uint8_t *buf, int len);
 uint8_t *ebuf_malloc(struct ebuf_t *p, int len);
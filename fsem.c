@@ -3,17 +3,22 @@
 /* (c) 2021 Martin Mather */
 
 #include <stdio.h>
-//#include <stdlib.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
 
 #include "fsem.h"
 #include "ebuf.h"
+#include "fsop.h"
+#include "log.h"
+#include "scsistat.h"
+#include "disc.h"
+#include "tick.h"
 
 #define KB 1024
-#define HOSTMEM 32
-#define MMSIZE (64+HOSTMEM)*KB
+#define HOSTMEM 32//KB, default
+#define HOSTMEM_MAX 63//HIMEM is read back as a page number, so 63.75K at most
 #define MMROM 0xf800
 #define SCSI_SECSIZE 0x100
 
@@ -30,7 +35,7 @@
 
 #define _BREAK_ brk = 1
 
-static uint8_t MM[MMSIZE], A, X, Y, SP, M;
+static uint8_t *MM, A, X, Y, SP, M;
 static uint16_t PC, XPC, L, R;
 static int N, V, Z, C, F, brk = 0;
 
@@ -38,25 +43,44 @@ static int state = FSEM_BUSY;
 
 static uint16_t mystn;
 static struct ebuf_t *txbuf = NULL;
-static FILE *scsi = NULL;
+static uint8_t txstatus = EB_STATUS_DONE;//of the last transmission
+static uint64_t instructions, sectors, scsiops;//run, read/written and commands, for fsop and the control socket
+static uint64_t scsireads, readsectors;
+static char *answers = "1,10";//to the questions at start up: drives, stations
+
+static int hostmem = HOSTMEM;//KB
+static uint32_t mmsize;//second processor's 64K then the host's
 
 static int keyevent = 0;
 #define EVENTV 0x0220
 
 
-static void _mmdump(uint32_t addr, int len) {
-	printf("mmdump: %08x:\n", addr);
+static uint8_t *_mm(uint32_t addr, uint32_t len) {
+	//Where addr is, host (I/O processor) addresses are folded in above the
+	//second processor's 64K.  NULL if addr to addr + len doesn't fit.
 	if (addr >= 0x10000)
 		addr = (addr & 0xffff) | 0x10000;//host memory
-	for (int i = 0; i < len; i++)
-		printf("%02x ", MM[addr + i]);
+	if (addr >= mmsize || len > mmsize - addr)
+		return NULL;
+	return MM + addr;
+}
+
+static void _mmdump(uint32_t addr, int len) {
+	uint8_t *m = _mm(addr, len);
+
+	printf("mmdump: %08x:\n", addr);
+	for (int i = 0; m && i < len; i++)
+		printf("%02x ", m[i]);
 	printf("\n");
 }
  
 int fsem_open(char *fname, uint32_t loadaddr, uint16_t stn, char *scsiname) {//load and run the fileserver
-	printf("FSEM:Run '%s' at %04x as station %d\n", fname, loadaddr, stn);
+	log_msg(LOGC_FSEM, LOGL_INFO, "Run '%s' at %04x as station %d", fname, loadaddr, stn);
 	int result = 0;
 	mystn = stn;
+	mmsize = 0x10000 + hostmem * KB;
+	if (!(MM = calloc(1, mmsize)))
+		return 0;
 	FILE *fp = fopen(fname, "r");
 
 	if (fp) {
@@ -66,7 +90,7 @@ int fsem_open(char *fname, uint32_t loadaddr, uint16_t stn, char *scsiname) {//l
 		//printf("filesize = %d, %08x\n", fsize, endaddr);
 
 		if (endaddr >= MMROM) {
-			printf("FSEM:File too large\n");
+			log_msg(LOGC_FSEM, LOGL_ERROR, "File too large");
 		} else  {
 			//printf("Loaded to %04x to %04x\n", loadaddr, endaddr - 1);
 			fseek(fp, 0, SEEK_SET);
@@ -76,23 +100,35 @@ int fsem_open(char *fname, uint32_t loadaddr, uint16_t stn, char *scsiname) {//l
 			PC = loadaddr;
 			//_mmdump(loadaddr, 32);
 			
-			scsi = fopen(scsiname, "r+");
-			if (scsi)
+			long discsize = disc_open(scsiname);
+			if (discsize >= 0) {
+				scsistat_disc(discsize);
 				result = 1;
+			}
 			else
-				printf("FSEM:Could not open SCSI disk image '%s'\n", scsiname);
+				log_msg(LOGC_FSEM, LOGL_ERROR, "Could not open SCSI disk image '%s'", scsiname);
 		}
 
 		fclose(fp);
 	} else
-		printf("FSEM:File not found\n");
+		log_msg(LOGC_FSEM, LOGL_ERROR, "File not found");
 	
 	return result;
 }
 
 void fsem_close(void) {
-	printf("FSEM:Close\n");
-	fclose(scsi);
+	log_msg(LOGC_FSEM, LOGL_INFO, "Close");
+	disc_close();
+	free(MM);
+	MM = NULL;
+}
+
+int fsem_hostmem(int kb) {
+	//Size of the emulated host memory, before fsem_open.
+	if (kb < 1 || kb > HOSTMEM_MAX)
+		return 0;
+	hostmem = kb;
+	return 1;
 }
 
 void fsem_sendkey(double optime, char key) {
@@ -125,18 +161,28 @@ static void _gettime(uint8_t *p) {
 	p[6] = n->tm_sec;//second (0-59);
 }
 
-static void _getline(uint8_t *p) {
-	static int n = 1;//number of drives
-
-	sprintf(p, "%d\r", n);
-	printf("%d\n", n);
-
-	n = 10;//number of stations
-
-	Y = 1;
+static void _getline(uint8_t *p, int maxlen) {
+	//Answer from the list, the last answer is repeated once it runs out.
+	static char *next = NULL;
+	char *a = next ? next : answers;
+	int n = strcspn(a, ",");
+
+	next = a[n] ? a + n + 1 : a;
+	if (n > maxlen)
+		n = maxlen;
+	memcpy(p, a, n);
+	p[n] = '\r';
+	log_flush();//after the question
+	log_msg(LOGC_FS, LOGL_INFO, "%.*s\n", n, a);
+
+	Y = n;
 	C = 0;
 }
 
+void fsem_answers(char *list) {
+	answers = list;
+}
+
 static int _nettransmit(uint8_t *p) {
 	/*printf("\n%04x TRANSMIT :\n", XPC);
 	printf("cb        = %02X\n", p[0]);
@@ -149,23 +195,30 @@ static int _nettransmit(uint8_t *p) {
 	if (p[0] >= 0x80) {//control byte >= 0x80
 		if (p[1]) {//port != 0
 			uint16_t stn = WORD(p, 2);
-
+			uint32_t start = DWORD(p, 4), end = DWORD(p, 8);
+			int len = end - start;
+			uint8_t *m;
+
+			if (stn == 0xffff) {//broadcast, the 8 data bytes are in the block
+				m = p + 4;
+				len = 8;
+			} else if (len < 0 || !(m = _mm(start, len))) {
+				log_msg(LOGC_FSEM, LOGL_WARN, "Transmit buffer %08x-%08x out of range", start, end);
+				return -1;
+			}
+			txbuf = ebuf_txfind();//ALWAYS ebufs[0]
+			uint8_t *t = ebuf_malloc(txbuf, len);
+			memcpy(t, m, len);
+			txbuf->station = stn;
+			txbuf->port = p[1];
+			txbuf->control = p[0];
+
+			txbuf->state = EB_STATE_SEND;
 			if (stn != 0xffff) {
-				txbuf = ebuf_txfind();//ALWAYS ebufs[0]
-				uint32_t start = DWORD(p, 4), end = DWORD(p, 8);
-				int len = end - start;
-				if (start >= 0x10000)
-					start = (start & 0xffff) | 0x10000;
-	
-				uint8_t *t = ebuf_malloc(txbuf, len);
-				memcpy(t, MM + start, len);
-				txbuf->station = stn;
-				txbuf->port = p[1];
-				txbuf->control = p[0];
-	
-				txbuf->state = EB_STATE_SEND;
-				return 0;//Actually want to send this.
-			}//else broadcast
+				disc_commit();//what the reply reports is on the disc first
+				fsop_reply(stn, p[1]);
+			}
+			return 0;//Actually want to send this.
 		}//else immediate operation indicated by control byte
 	}//else malformed
 	
@@ -177,25 +230,30 @@ static void _netreceive(uint8_t *p) {
 	struct ebuf_t *rxbuf;
 
 	if (!p[0]) {//create new receive block
+		uint32_t start = DWORD(p, 5), end = DWORD(p, 9);
+		int len = end - start;
+
+		if (len < 0 || !_mm(start, len)) {
+			p[0] = 0;
+			log_msg(LOGC_FSEM, LOGL_WARN, "Receive buffer %08x-%08x out of range", start, end);
+			return;
+		}
 		rxbuf = ebuf_new();
 	
 		if (rxbuf) {
-			uint32_t start = DWORD(p, 5), end = DWORD(p, 9);
-			int len = end - start;
-
 			rxbuf->station = WORD(p, 3);// station
 			rxbuf->control = p[1];//control
 			rxbuf->port = p[2];// port
 			rxbuf->len = len;// max length
-			rxbuf->state = EB_STATE_LISTENING;
 			rxbuf->addr = start;
+			ebuf_rxopen(rxbuf);
 	
 			p[0] = rxbuf->index;
 			//printf("%04x new buf %d\n", XPC, rxbuf->index);
 			//ebuf_list();
 		} else {
 			p[0] = 0;
-			printf("FSEM:Couldn't create ebuf\n");
+			log_msg(LOGC_FSEM, LOGL_WARN, "Couldn't create ebuf");
 		}
 	} else {// read & delete receive block
 		//printf("%04x read rx block %d\n", XPC, p[0]);
@@ -203,16 +261,16 @@ static void _netreceive(uint8_t *p) {
 
 		if (rxbuf) {// assume state == EB_STATE_RECEIVED
 			if (rxbuf->state == EB_STATE_RECEIVED) {
-				uint32_t start = rxbuf->addr, end = rxbuf->addr + rxbuf->len;
-				if (start >= 0x10000)
-					start = (start & 0xffff) | 0x10000;
+				uint32_t end = rxbuf->addr + rxbuf->len;
+				uint8_t *m = _mm(rxbuf->addr, rxbuf->len);
 
 				/*printf("start = %x\n", start);
 				printf("len   = %x\n", rxbuf->len);
 				printf("sa  = %x\n", rxbuf->addr);
 				printf("ea  = %x\n", end);*/
 
-				memcpy(MM + start, rxbuf->buf, rxbuf->len);
+				if (m)//checked when opened, len is no more than asked for
+					memcpy(m, rxbuf->buf, rxbuf->len);
 
 				//_mmdump(rxbuf->addr,rxbuf->len);
 
@@ -237,28 +295,33 @@ static void _netreceive(uint8_t *p) {
 
 static void _scsi(uint8_t *p) {
 	uint32_t addr = DWORD(p, 1);
-	if (addr >= 0x10000)
-		addr = (addr & 0xffff) | 0x10000;//host memory
-	uint8_t *datap = MM + addr;
 	int result = 4, rw = 0, sec = ((p[6] & 0x1f) << 16) | (p[7] << 8) | p[8];
 	int len = p[9] * SCSI_SECSIZE;
+	uint64_t t;
 	if (!len)
 		len = DWORD(p, 11);
+	uint8_t *datap = _mm(addr, len);
 
 	switch (p[5]) {
 		case 0x08://read
 		case 0x0a://write
 			//printf("%04x SCSI read/write: cmd=%x addr=%08x sec=%06x len=%04x", XPC, p[5], addr, sec, len);
-			if (!fseek(scsi, sec * SCSI_SECSIZE, SEEK_SET)) {
+			t = tick_us();
+			if (datap) {
 				if (p[5] == 0x08)
-					rw = fread(datap, 1, len, scsi);
-				else {
-					rw = fwrite(datap, 1, len, scsi);
-					//fflush(scsi);
-				}
+					rw = disc_read(sec, datap, len);
+				else
+					rw = disc_write(sec, datap, len);
 			}
 
 			//printf(" : rw=%04x\n", rw);
+			scsistat_io(p[5] == 0x0a, sec, rw / SCSI_SECSIZE, tick_us() - t);
+			scsiops++;
+			sectors += rw / SCSI_SECSIZE;
+			if (p[5] == 0x08) {
+				scsireads++;
+				readsectors += rw / SCSI_SECSIZE;
+			}
 			if (rw == len)
 				result = 0;
 			break;
@@ -308,7 +371,7 @@ static void _oswrch(char chr) {
 
 		if (v && e) {
 			if (!c)
-				printf("%c", chr);
+				log_putc(chr);
 			//else
 			//	printf("\n");
 		}
@@ -320,7 +383,7 @@ static void _osword() {
 	switch (A) {
 		case 0x00://read line input
 			//printf("get input from user max=%d buf@%04x\n", p[2], WORD(p, 0));
-			_getline(MM + WORD(p, 0));
+			_getline(MM + WORD(p, 0), p[2]);
 			break;
 		case 0x0e://read clock
 			//printf("CLOCK : %02x\n", p[0]);
@@ -350,15 +413,19 @@ static void _osword() {
 			_scsi(p);
 			break;
 		case 0x73://SCSI last error
-			//printf("\nSCSI ERROR? :\n");
-			p[0]=0;//sector
-			p[1]=0;
-			p[2]=0;
-			p[3]=0;
-			p[4]=0;
+			{
+				uint32_t sec;
+				int err = disc_error(&sec);
+
+				p[0] = sec;//sector, drive 0
+				p[1] = sec >> 8;
+				p[2] = (sec >> 16) & 0x1f;
+				p[3] = err;
+				p[4] = 0;
+			}
 			break;
 		default:
-			printf("\n%04x OSWORD : A=%02x X=%02x Y=%02x\n", XPC, A, X, Y);
+			log_msg(LOGC_FSEM, LOGL_ERROR, "%04x OSWORD : A=%02x X=%02x Y=%02x", XPC, A, X, Y);
 			_BREAK_;
 			break;
 	}
@@ -375,7 +442,9 @@ static void _osbyte() {
 		case 0x0f://flush buffer X
 			break;
 		case 0x32://poll transmit
-			_BREAK_;//Shouldn't happen.
+			//Transmissions complete as soon as they're queued, this is the
+			//final result of the latest one (0x80 while still in progress).
+			fsem_loadX(txstatus);
 			break;
 		case 0x33://poll receive, X=block number
 			//printf("%04X POLL RCV  (BLOCK)X=%d  (WAIT)Y=%d\n", XPC, X, Y);
@@ -386,26 +455,23 @@ static void _osbyte() {
 			//WAIT TIMES:
 			//Y=1 wait until something received or key pressed
 			//Y=2 wait for 1 second only
-			//    (Only used when expecting reply to a broadcast which will not be sent,
-			//     so not implemented.)
+			//    (Used when expecting replies to a broadcast.)
 			//Y>2 wait 1 minute
 			
 			//Should return with result in X:
 			//X==0x00 == nothing received
 			//X==0x80 == data received
 			
-			if (Y == 2)//No broadcast, so
-				fsem_loadX(0x00);//nothing received
-			else {
-				ebuf_listen(X);//X=RXBN
-				
-				if (Y == 1)
-					state = FSEM_WAIT0;
-				else
-					state = FSEM_WAIT2;
+			ebuf_listen(X);//X=RXBN
+			
+			if (Y == 1)
+				state = FSEM_WAIT0;
+			else if (Y == 2)
+				state = FSEM_WAIT1;
+			else
+				state = FSEM_WAIT2;
 
-				_BREAK_;//STOP EXECUTING
-			}
+			_BREAK_;//STOP EXECUTING
 			break;
 		case 0x34://delete receive control block X
 			ebuf_kill(ebuf_x(X));
@@ -418,7 +484,7 @@ static void _osbyte() {
 		case 0x85://read bottom of display ram (HIMEM) for Mode X
 			//exit YX = address
 			X = 0;
-			Y = HOSTMEM << 2;
+			Y = hostmem << 2;
 			break;
 		case 0x87://read character at text cursor, and screen mode
 			//exit X=character, Y=mode
@@ -432,7 +498,7 @@ static void _osbyte() {
 		case 0xe5://read/write ESCAPE key status
 			break;
 		default:
-			printf("\n%04x OSBYTE : A=%02x X=%02x Y=%02x\n", XPC, A, X, Y);
+			log_msg(LOGC_FSEM, LOGL_ERROR, "%04x OSBYTE : A=%02x X=%02x Y=%02x", XPC, A, X, Y);
 			_BREAK_;
 			break;
 	}
@@ -441,7 +507,7 @@ static void _osbyte() {
 static int _romcall() {
 	switch (PC) {
 		case 0xf800://reset
-			printf("RESET\n");
+			log_msg(LOGC_FSEM, LOGL_INFO, "RESET");
 			_BREAK_;
 			break;
 		case 0xffe0://OSRDCH
@@ -467,7 +533,7 @@ static int _romcall() {
 			//printf("%04x OSCLI : X=%02x Y=%02x\n", XPC, X, Y);
 			break;
 		default:
-			printf("%04x ROM CALL %04x\n", XPC, PC);
+			log_msg(LOGC_FSEM, LOGL_ERROR, "%04x ROM CALL %04x", XPC, PC);
 			_BREAK_;
 			break;
 	}
@@ -487,6 +553,39 @@ void fsem_loadX(uint8_t v) {
 	X = NZ(v);
 }
 
+void fsem_txstatus(uint8_t status) {
+	txstatus = status;
+}
+
+int fsem_peek(uint32_t addr, uint8_t *buf, int len) {//for immediate PEEK, emulator thread only
+	uint8_t *m = _mm(addr, 1);
+
+	if (!m || len <= 0)
+		return 0;
+	if (len > MM + mmsize - m)
+		len = MM + mmsize - m;
+	memcpy(buf, m, len);
+	return len;
+}
+
+uint64_t fsem_instructions(void) {
+	return instructions;
+}
+
+uint64_t fsem_sectors(void) {
+	return sectors;
+}
+
+uint64_t fsem_scsiops(void) {
+	return scsiops;
+}
+
+uint64_t fsem_scsireads(uint64_t *sectors_read) {
+	if (sectors_read)
+		*sectors_read = readsectors;
+	return scsireads;
+}
+
 int fsem_exec(double optime, int jsr) {
 	int op, i, i2, j;
 	clock_t timeout = clock() + optime * CLOCKS_PER_SEC;
@@ -496,6 +595,7 @@ int fsem_exec(double optime, int jsr) {
 	state = FSEM_BUSY;
 	brk = 0;
 	while (!brk && clock() < timeout) {
+		instructions++;
 		XPC = PC;
 		if (PC >= 0xf800)
 			op = 0x60;//ROM, read rts
@@ -510,7 +610,7 @@ int fsem_exec(double optime, int jsr) {
 			switch (j) {
 				case 0://brk
 					PC = WORD(MM, 0x0202);//BRKV
-					printf("FSEM:BRK PC=%04x\n", PC);
+					log_msg(LOGC_FSEM, LOGL_WARN, "BRK PC=%04x", PC);
 					_BREAK_;
 					break;
 				case 1://jsr, absolute
@@ -786,7 +886,7 @@ int fsem_exec(double optime, int jsr) {
 	}
 
 	if (!jsr && brk && state == FSEM_BUSY) {
-		printf("%04x BREAK ***************************\n", PC);
+		log_msg(LOGC_FSEM, LOGL_ERROR, "%04x BREAK ***************************", PC);
 		state = FSEM_BREAK;
 	}
 	
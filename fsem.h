@@ -18,4 +18,12 @@ void fsem_close(void);
 void fsem_sendkey(double optime, char key);
 int fsem_exec(double optime, int jsr);
 void fsem_loadX(uint8_t v);
-void fsem_loadA(uint8_t v);
\ No newline at end of file
+void fsem_loadA(uint8_t v);
+int fsem_peek(uint32_t addr, uint8_t *buf, int len);
+void fsem_txstatus(uint8_t status);
+uint64_t fsem_instructions(void);
+uint64_t fsem_sectors(void);
+uint64_t fsem_scsiops(void);
+uint64_t fsem_scsireads(uint64_t *sectors_read);
+void fsem_answers(char *list);
+int fsem_hostmem(int kb);
\ No newline at end of file
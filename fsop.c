@@ -0,0 +1,189 @@
+/* File Server Emulator   */
+/* fsop.c                 */
+/* (c) 2021 Martin Mather */
+
+/* What each file server operation costs.  An operation starts when a */
+/* request on the command port is handed to the FS and is answered by  */
+/* its first transmission back to that station's reply port.  The      */
+/* 6502 instructions and SCSI sectors it uses are counted up to its    */
+/* last transmission before the next request is taken.                 */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fsop.h"
+#include "fsem.h"
+#include "tick.h"
+
+static const char *names[] = {
+	"command", "save", "load", "examine", "cathead", "loadcmd", "open", "close",
+	"getbyte", "putbyte", "getbytes", "putbytes", "readargs", "setargs", "discs", "users",
+	"readtime", "eof", "readinfo", "setinfo", "delete", "readenv", "setopt", "logoff",
+	"userinfo", "version", "free", "cdir", "settime", "create", "userfree", "setfree",
+	"whoami",
+};
+
+static struct opstat_t {
+	uint32_t answered, unanswered, costed;
+	uint32_t hist[FSOP_BUCKETS];
+	uint64_t total_us;
+	uint32_t max_us;
+	uint64_t instructions, sectors;
+	uint64_t max_instructions;
+} *ops[256];
+
+static struct {//the one the FS is working on
+	int active, replied;
+	uint16_t stn;
+	uint8_t port, fn;
+	uint32_t rx_us;
+	uint64_t instructions, sectors;//at the start
+	uint64_t end_instructions, end_sectors;//at the last transmission
+} cur;
+
+static char *expname;
+static int period;//ms
+static uint32_t lastexport;
+
+static int _bucket(uint32_t us) {
+	int b = 0;
+
+	while (us > 1 && b < FSOP_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static void _finish(void) {
+	struct opstat_t *o = ops[cur.fn];
+
+	if (!cur.active)
+		return;
+	cur.active = 0;
+	if (!o && !(o = ops[cur.fn] = calloc(1, sizeof(struct opstat_t))))
+		return;
+
+	if (!cur.replied) {
+		o->unanswered++;
+		return;
+	}
+	o->costed++;
+	uint64_t instr = cur.end_instructions - cur.instructions;
+	o->instructions += instr;
+	o->sectors += cur.end_sectors - cur.sectors;
+	if (instr > o->max_instructions)
+		o->max_instructions = instr;
+}
+
+void fsop_export(char *fname, int period_s) {
+	//Write the stats to fname every period_s seconds.
+	expname = fname;
+	period = period_s * 1000;
+	lastexport = tick_ms();
+}
+
+void fsop_begin(uint16_t stn, uint8_t replyport, uint8_t fn, uint32_t rx_us) {
+	_finish();
+	cur.active = 1;
+	cur.replied = 0;
+	cur.stn = stn;
+	cur.port = replyport;
+	cur.fn = fn;
+	cur.rx_us = rx_us;
+	cur.instructions = cur.end_instructions = fsem_instructions();
+	cur.sectors = cur.end_sectors = fsem_sectors();
+}
+
+void fsop_reply(uint16_t stn, uint8_t port) {
+	if (!cur.active || stn != cur.stn)
+		return;
+
+	cur.end_instructions = fsem_instructions();
+	cur.end_sectors = fsem_sectors();
+	if (cur.replied || port != cur.port)
+		return;
+	cur.replied = 1;
+
+	struct opstat_t *o = ops[cur.fn];
+	if (!o && !(o = ops[cur.fn] = calloc(1, sizeof(struct opstat_t))))
+		return;
+
+	uint32_t us = (uint32_t) tick_us() - cur.rx_us;
+	o->answered++;
+	o->hist[_bucket(us)]++;
+	o->total_us += us;
+	if (us > o->max_us)
+		o->max_us = us;
+}
+
+static uint32_t _percentile(struct opstat_t *o, int pc) {
+	//upper bound of the bucket holding the pc'th percentile, us
+	uint32_t n = 0, total = o->answered;
+
+	for (int b = 0; b < FSOP_BUCKETS; b++) {
+		n += o->hist[b];
+		if (n * 100 >= total * pc)
+			return (b == FSOP_BUCKETS - 1) ? o->max_us : 2u << b;
+	}
+	return 0;
+}
+
+void fsop_stats(FILE *f) {
+	for (int fn = 0; fn < 256; fn++) {
+		struct opstat_t *o = ops[fn];
+
+		if (!o)
+			continue;
+
+		if (fn < sizeof(names) / sizeof(names[0]))
+			fprintf(f, "FSOP:%-8s", names[fn]);
+		else
+			fprintf(f, "FSOP:fn%-6d", fn);
+		fprintf(f, " count=%u unanswered=%u", o->answered, o->unanswered);
+		if (o->answered)
+			fprintf(f, " mean=%lluus p50<%uus p99<%uus max=%uus",
+				(unsigned long long) (o->total_us / o->answered), _percentile(o, 50), _percentile(o, 99), o->max_us);
+		if (o->costed)
+			fprintf(f, " instructions=%llu (max %llu) sectors=%.1f",
+				(unsigned long long) (o->instructions / o->costed), (unsigned long long) o->max_instructions,
+				(double) o->sectors / o->costed);
+		fprintf(f, " hist=");
+		for (int b = 0; b < FSOP_BUCKETS; b++)
+			fprintf(f, "%s%u", b ? "," : "", o->hist[b]);
+		fprintf(f, "\n");
+	}
+}
+
+void fsop_poll(void) {
+	char tmp[512];
+	FILE *f;
+
+	if (!expname || (int32_t) (tick_ms() - lastexport) < period)
+		return;
+	lastexport = tick_ms();
+
+	//write it all, then swap it in, so a reader never sees half a file
+	snprintf(tmp, sizeof(tmp), "%s.tmp", expname);
+	if (!(f = fopen(tmp, "w"))) {
+		printf("FSOP:Couldn't write '%s'\n", tmp);
+		expname = NULL;
+		return;
+	}
+	fsop_stats(f);
+	fclose(f);
+	rename(tmp, expname);
+}
+
+void fsop_close(void) {
+	_finish();
+	if (expname) {
+		lastexport -= period;
+		fsop_poll();
+	}
+	for (int fn = 0; fn < 256; fn++) {
+		free(ops[fn]);
+		ops[fn] = NULL;
+	}
+}
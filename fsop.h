@@ -0,0 +1,12 @@
+/* File Server Emulator   */
+/* fsop.h                 */
+/* (c) 2021 Martin Mather */
+
+#define FSOP_BUCKETS	25	// log2 us latency buckets, the last is 16s and over
+
+void fsop_export(char *fname, int period_s);
+void fsop_begin(uint16_t stn, uint8_t replyport, uint8_t fn, uint32_t rx_us);
+void fsop_reply(uint16_t stn, uint8_t port);
+void fsop_poll(void);
+void fsop_stats(FILE *f);
+void fsop_close(void);
@@ -0,0 +1,72 @@
+/* File Server Emulator   */
+/* imm.c                  */
+/* (c) 2021 Martin Mather */
+
+/* Immediate operations are answered by the host, without involving the  */
+/* file server code, so they get a reply whatever the 6502 is doing.      */
+/* Peeks read emulated memory, so they're answered on the emulator thread */
+/* between instructions.  The rest are answered by the I/O thread.        */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "aun.h"
+#include "imm.h"
+#include "fsem.h"
+
+static uint16_t machine = IMM_MACHINE, version = IMM_VERSION;
+static uint32_t count[16], unhandled;
+
+#define DWORD(a, l) (a[l] | (a[l+1] << 8) | (a[l+2] << 16) | (a[l+3] << 24))
+
+void imm_setmachine(uint16_t type, uint16_t v) {
+	machine = type;
+	version = v;
+}
+
+int imm_reply(uint8_t *buf, int len, int maxlen) {
+	//buf holds the received packet, it's turned into the reply in place.
+	//Returns the length of the reply, or 0 if there's nothing to send.
+	uint8_t *d = buf + AUN_HDR_SIZE;
+	int n = 0;
+
+	switch (buf[2]) {//control byte
+		case ECONET_PEEK:
+			//data: start address (4 bytes), end address (4 bytes)
+			if (len >= AUN_HDR_SIZE + 8) {
+				uint32_t start = DWORD(d, 0), end = DWORD(d, 4);
+
+				if (end <= start)//nothing asked for, a reply with no data
+					n = 0;
+				else if (end - start > (uint32_t) (maxlen - AUN_HDR_SIZE))
+					n = fsem_peek(start, d, maxlen - AUN_HDR_SIZE);
+				else
+					n = fsem_peek(start, d, end - start);
+			} else
+				return 0;
+			break;
+		case ECONET_MACHINEPEEK:
+			//printf("MACHINE PEEK\n");
+			d[0] = machine;
+			d[1] = machine >> 8;
+			d[2] = version;//nfs x.60
+			d[3] = version >> 8;//nfs 3.xx
+			n = 4;
+			break;
+		default://poke, jsr, halt etc. are not for a file server
+			//printf("Unhandled\n");
+			__atomic_fetch_add(&unhandled, 1, __ATOMIC_RELAXED);//either thread
+			return 0;
+	}
+
+	__atomic_fetch_add(&count[buf[2] & 15], 1, __ATOMIC_RELAXED);//either thread
+	buf[0] = AUN_TYPE_IMM_REPLY;//reuse rest of received header
+	return AUN_HDR_SIZE + n;
+}
+
+void imm_stats(void) {
+	printf("IMM:peek=%u machinepeek=%u unhandled=%u\n",
+		__atomic_load_n(&count[ECONET_PEEK], __ATOMIC_RELAXED),
+		__atomic_load_n(&count[ECONET_MACHINEPEEK], __ATOMIC_RELAXED),
+		__atomic_load_n(&unhandled, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,10 @@
+/* File Server Emulator   */
+/* imm.h                  */
+/* (c) 2021 Martin Mather */
+
+#define IMM_MACHINE	0x0001	// BBC Micro
+#define IMM_VERSION	0x0360	// NFS 3.60
+
+void imm_setmachine(uint16_t type, uint16_t version);
+int imm_reply(uint8_t *buf, int len, int maxlen);
+void imm_stats(void);
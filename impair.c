@@ -0,0 +1,175 @@
+/* File Server Emulator   */
+/* impair.c               */
+/* (c) 2021 Martin Mather */
+
+/* Optional network impairment, to see how the server copes with a bad */
+/* network without needing netem.  Packets to and from a station can be */
+/* lost, duplicated, delayed or held back so others overtake them.  The */
+/* random numbers are seeded so a run can be repeated.                  */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aun.h"
+#include "impair.h"
+
+struct icount_t {
+	uint32_t packets, dropped, duplicated, delayed, reordered;
+};
+
+static struct irule_t {
+	int all;//applies to every station without its own rule
+	uint16_t stn;
+	int dirs;//bit per direction
+	uint32_t loss, dup, reorder;//per million
+	int delay, jitter, gap;//ms
+	struct icount_t count[2];
+} rules[IMPAIR_RULES];
+
+static int nrules;
+static uint64_t seed = 1, rng = 1;
+
+static uint64_t _rand(void) {//xorshift64*
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ull;
+}
+
+static int _chance(uint32_t ppm) {
+	return ppm && (_rand() >> 32) % 1000000 < ppm;
+}
+
+static uint32_t _ppm(char *s) {//percentage
+	double p = atof(s);
+	return (p <= 0) ? 0 : (p >= 100) ? 1000000 : (uint32_t) (p * 10000);
+}
+
+int impair_config(char *spec) {
+	//spec is [net.stn:]key=value,...  eg "loss=2,delay=20" or "1.101:dup=5,dir=tx"
+	//keys: loss, dup, reorder (percent), delay, jitter, gap (ms), dir (rx, tx or both), seed
+	//Returns 0 if the spec is no good.
+	char buf[128], *key, *c, *eq;
+	unsigned net = 0, stn;
+	struct irule_t r = { .all = 1, .dirs = 3, .gap = IMPAIR_GAP };
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	key = buf;
+	c = strchr(buf, ':');
+	eq = strchr(buf, '=');
+	if (c && (!eq || c < eq)) {
+		*c = 0;
+		if (sscanf(buf, "%u.%u", &net, &stn) != 2 && (net = 0, sscanf(buf, "%u", &stn) != 1))
+			return 0;
+		r.all = 0;
+		r.stn = AUN_ADDR(net & 0x7f, stn & 0xff);
+		key = c + 1;
+	}
+
+	for (key = strtok(key, ","); key; key = strtok(NULL, ",")) {
+		char *val = strchr(key, '=');
+
+		if (!val)
+			return 0;
+		*val++ = 0;
+		if (!strcmp(key, "loss"))
+			r.loss = _ppm(val);
+		else if (!strcmp(key, "dup"))
+			r.dup = _ppm(val);
+		else if (!strcmp(key, "reorder"))
+			r.reorder = _ppm(val);
+		else if (!strcmp(key, "delay"))
+			r.delay = atoi(val);
+		else if (!strcmp(key, "jitter"))
+			r.jitter = atoi(val);
+		else if (!strcmp(key, "gap"))
+			r.gap = atoi(val);
+		else if (!strcmp(key, "dir"))
+			r.dirs = !strcmp(val, "rx") ? 1 << IMPAIR_RX : !strcmp(val, "tx") ? 1 << IMPAIR_TX : 3;
+		else if (!strcmp(key, "seed")) {
+			seed = strtoull(val, NULL, 0);
+			rng = seed ? seed : 1;
+		} else
+			return 0;
+	}
+	if (r.delay < 0 || r.jitter < 0 || r.gap < 0)
+		return 0;//jitter is used as a modulus
+
+	if (r.loss || r.dup || r.reorder || r.delay || r.jitter) {
+		if (nrules == IMPAIR_RULES)
+			return 0;
+		rules[nrules++] = r;
+	}
+	return 1;
+}
+
+static struct irule_t *_rule(uint16_t stn, int dir) {
+	struct irule_t *any = NULL;
+
+	for (int i = 0; i < nrules; i++) {
+		struct irule_t *r = &rules[i];
+		if (!(r->dirs & (1 << dir)))
+			continue;
+		if (!r->all && r->stn == stn)
+			return r;
+		if (r->all && !any)
+			any = r;
+	}
+	return any;
+}
+
+int impair_packet(uint16_t stn, int dir, int *delay) {
+	//Decide what happens to a packet.  Returns how many copies to pass on
+	//(0, 1 or 2) and the ms to hold each one back in delay[].
+	struct irule_t *r = nrules ? _rule(stn, dir) : NULL;
+	int n = 1;
+
+	delay[0] = 0;
+	if (!r)
+		return 1;
+
+	struct icount_t *c = &r->count[dir];
+	c->packets++;
+	if (_chance(r->loss)) {
+		c->dropped++;
+		return 0;
+	}
+	if (_chance(r->dup)) {
+		c->duplicated++;
+		n = 2;
+	}
+	for (int i = 0; i < n; i++) {
+		delay[i] = r->delay;
+		if (r->jitter)
+			delay[i] += _rand() % (r->jitter + 1);
+		if (_chance(r->reorder)) {
+			c->reordered++;
+			delay[i] += r->gap;
+		}
+		if (delay[i])
+			c->delayed++;
+	}
+	return n;
+}
+
+void impair_stats(void) {
+	if (!nrules)
+		return;
+	printf("IMPAIR:seed=%llu\n", (unsigned long long) seed);
+	for (int i = 0; i < nrules; i++) {
+		struct irule_t *r = &rules[i];
+		char who[16];
+
+		if (r->all)
+			snprintf(who, sizeof(who), "all");
+		else
+			snprintf(who, sizeof(who), "%d.%d", AUN_NET(r->stn), AUN_STN(r->stn));
+		for (int d = 0; d < 2; d++)
+			if (r->dirs & (1 << d))
+				printf("IMPAIR:%-7s %s packets=%u dropped=%u duplicated=%u delayed=%u reordered=%u\n",
+					who, d == IMPAIR_RX ? "rx" : "tx", r->count[d].packets, r->count[d].dropped,
+					r->count[d].duplicated, r->count[d].delayed, r->count[d].reordered);
+	}
+}
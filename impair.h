@@ -0,0 +1,12 @@
+/* File Server Emulator   */
+/* impair.h               */
+/* (c) 2021 Martin Mather */
+
+#define IMPAIR_RX	0
+#define IMPAIR_TX	1
+#define IMPAIR_RULES	16
+#define IMPAIR_GAP	50	// ms, how far a reordered packet is held back
+
+int impair_config(char *spec);
+int impair_packet(uint16_t stn, int dir, int *delay);
+void impair_stats(void);
@@ -0,0 +1,1072 @@
+/* File Server Emulator   */
+/* l3disc.c               */
+/* (c) 2021 Martin Mather */
+
+/* Level 3 disc image tool.  Lists, extracts, imports and deletes files */
+/* and directories in a SCSI disc image while the server isn't running. */
+/* The image is mapped into memory and changed in place, allocating the */
+/* way FS 1.26 does: a new object goes in the cylinder with the most    */
+/* free sectors, its map first and then its data, carrying on into the  */
+/* following cylinders when it doesn't fit.  The image is locked while  */
+/* in use, so neither this nor the server will open it under the other. */
+/*                                                                      */
+/* On disc: sector 0 points at the AFS0 block giving the geometry and   */
+/* the root directory.  Each cylinder from the one holding AFS0 starts  */
+/* with a bitmap of its free sectors.  An object is named by the sector */
+/* of its map (SIN), a JesMap block listing the extents of its data.    */
+/* A directory keeps its entries in a list sorted by name and the       */
+/* unused ones in a free list.                                          */
+/*                                                                      */
+/* If the image has a checksum file (fsem -c on), scrub checks every    */
+/* sector against it and names the file each bad sector belongs to.     */
+/* Changes are refused while any sector is bad, and the checksums are   */
+/* brought up to date afterwards.  Checksums that aren't of the image   */
+/* as it is (a crash, a restore) aren't checked, only remade.           */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc.h"
+
+#define SECSIZE	0x100
+#define NAMELEN	10
+#define MAXSIZE	0xffffff	// lengths are 3 bytes
+
+#define MAPHEAD	10	// map: "JesMap", sequence, 0, length of last sector, 0
+#define MAPEXTS	48	// extents of 3 byte start and 2 byte count, to 0xfa
+#define MAPSEQ	0xff	// copy of the sequence number
+
+#define DIRHEAD	0x11	// directory: first, sequence, name, free, count
+#define DIRNEWSIZE	0x200	// a new directory
+#define ENTSIZE	26
+#define E_NEXT	0
+#define E_NAME	2
+#define E_LOAD	12
+#define E_EXEC	16
+#define E_ACC	20
+#define E_DATE	21
+#define E_SIN	23
+
+#define ACC_r	0x01
+#define ACC_w	0x02
+#define ACC_R	0x04
+#define ACC_W	0x08
+#define ACC_L	0x10
+#define ACC_D	0x20
+#define ACC_FILE	(ACC_R | ACC_W)	// as the FS saves a file
+#define ACC_DIR	(ACC_D | ACC_L)
+
+#define SCRUBMAX	256	// bad sectors named
+
+#define BADCHARS	" .:*#$&@^%\\|\""
+
+typedef struct {
+	uint32_t sin;
+	uint8_t *m;	// the map, in the image
+	int n;	// extents
+	uint32_t sectors, size;
+} obj_t;
+
+static uint8_t *img;
+static long nsec;
+static uint32_t spc, cyls, first;
+static uint32_t root;
+static int errors, recurse;
+static int imgfd = -1, sumfd = -1;
+static uint32_t *sums, nsums;
+static int stale;//the checksums aren't of the image as it is
+
+static uint32_t _u16(uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t _u24(uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+static uint32_t _u32(uint8_t *p) {
+	return _u24(p) | (uint32_t) p[3] << 24;
+}
+
+static void _put16(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void _put24(uint8_t *p, uint32_t v) {
+	_put16(p, v);
+	p[2] = v >> 16;
+}
+
+static void _put32(uint8_t *p, uint32_t v) {
+	_put24(p, v);
+	p[3] = v >> 24;
+}
+
+static uint8_t *_sec(uint32_t s) {
+	//NULL past the end of the image.
+	return s < nsec ? img + (size_t) s * SECSIZE : NULL;
+}
+
+static void _fail(char *what, char *name) {
+	fprintf(stderr, "%s: %s\n", name, what);
+	errors++;
+}
+
+static uint32_t _badsectors(uint32_t *bad, uint32_t max) {
+	//Sectors that don't match their checksums, the first max of them kept.
+	uint32_t s, n = 0;
+
+	for (s = 0; s < nsums; s++)
+		if (crc32c(_sec(s), SECSIZE) != sums[s] && n++ < max && bad)
+			bad[n - 1] = s;
+	return n;
+}
+
+static void _sumload(char *path, int write, struct stat *img) {
+	//The checksum file the server keeps beside the image, if there is one.
+	char name[4096];
+	struct crchead_t h;
+	struct stat st;
+	uint32_t n;
+
+	snprintf(name, sizeof(name), "%s.crc", path);
+	if ((sumfd = open(name, write ? O_RDWR : O_RDONLY)) < 0)
+		return;
+	if (fstat(sumfd, &st) || pread(sumfd, &h, sizeof(h), 0) != (ssize_t) sizeof(h) || h.magic != CRCMAGIC || !h.clean
+		|| h.size != img->st_size || h.sec != img->st_mtim.tv_sec || h.nsec != img->st_mtim.tv_nsec) {
+		//left by a crash, or the image was restored: all of them are remade after a change
+		stale = 1;
+		nsums = write ? nsec : 0;
+	} else {
+		nsums = (st.st_size - sizeof(h)) / sizeof(*sums);
+		nsums = nsums < nsec ? nsums : nsec;
+	}
+	if (!(sums = malloc((nsums + 1) * sizeof(*sums)))
+		|| (!stale && pread(sumfd, sums, nsums * sizeof(*sums), sizeof(h)) != (ssize_t) (nsums * sizeof(*sums)))) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	if (write && !stale && (n = _badsectors(NULL, 0))) {
+		fprintf(stderr, "%s: %u sectors don't match their checksums, see scrub\n", path, n);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void _open(char *path, int write) {
+	struct stat st;
+	struct flock lk = {.l_type = write ? F_WRLCK : F_RDLCK, .l_whence = SEEK_SET};
+	uint8_t *a;
+	int fd;
+
+	if ((fd = open(path, write ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &st)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	//the lock is held until exit, fsem takes the same one
+	if (fcntl(fd, F_SETLK, &lk)) {
+		fprintf(stderr, "%s: in use, stop the file server first\n", path);
+		exit(EXIT_FAILURE);
+	}
+	nsec = st.st_size / SECSIZE;
+	img = mmap(NULL, st.st_size, PROT_READ | (write ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	if (img == MAP_FAILED) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (nsec < 2 || !(a = _sec(_u24(img + 0xf6))) || memcmp(a, "AFS0", 4)) {
+		fprintf(stderr, "%s: not a Level 3 disc\n", path);
+		exit(EXIT_FAILURE);
+	}
+	cyls = _u16(a + 0x14);
+	spc = _u16(a + 0x1a);
+	root = _u24(a + 0x1f);
+	if (!spc || spc > SECSIZE * 8 || a[0x1c] != 1) {
+		fprintf(stderr, "%s: unsupported geometry\n", path);
+		exit(EXIT_FAILURE);
+	}
+	//the cylinders before the AFS0 block aren't allocated from
+	first = _u24(img + 0xf6) / spc;
+	if (cyls > (nsec + spc - 1) / spc)
+		cyls = (nsec + spc - 1) / spc;
+	imgfd = fd;
+	_sumload(path, write, &st);
+}
+
+static void _close(void) {
+	struct crchead_t h;
+	struct stat st;
+	uint32_t s;
+
+	if (msync(img, (size_t) nsec * SECSIZE, MS_SYNC))
+		perror("msync");
+	if (sumfd < 0)
+		return;
+	for (s = 0; s < nsums; s++)
+		sums[s] = crc32c(_sec(s), SECSIZE);
+	//the sums, then the header saying they're right for the image as it's left
+	h.magic = CRCMAGIC;
+	h.clean = 1;
+	if (fsync(imgfd) || fstat(imgfd, &st)
+		|| pwrite(sumfd, sums, nsums * sizeof(*sums), sizeof(h)) != (ssize_t) (nsums * sizeof(*sums)) || fsync(sumfd)) {
+		perror("checksums");
+		return;
+	}
+	h.size = st.st_size;
+	h.sec = st.st_mtim.tv_sec;
+	h.nsec = st.st_mtim.tv_nsec;
+	if (pwrite(sumfd, &h, sizeof(h), 0) != (ssize_t) sizeof(h) || fsync(sumfd))
+		perror("checksums");
+}
+
+// free space
+
+static uint8_t *_bit(uint32_t s, int *mask) {
+	*mask = 1 << (s % spc & 7);
+	return _sec(s / spc * spc) + (s % spc >> 3);
+}
+
+static int _isfree(uint32_t s) {
+	int mask;
+
+	if (s >= nsec || !(s % spc) || s / spc < first)
+		return 0;
+	return *_bit(s, &mask) & mask;
+}
+
+static void _mark(uint32_t s, int isfree) {
+	int mask;
+	uint8_t *p = _bit(s, &mask);
+
+	*p = isfree ? *p | mask : *p & ~mask;
+}
+
+static uint32_t _cylfree(uint32_t c) {
+	uint32_t s, n = 0;
+
+	for (s = c * spc; s < (c + 1) * spc; s++)
+		n += _isfree(s) != 0;
+	return n;
+}
+
+static int _alloc(uint32_t n, uint32_t *start, uint32_t *count, int max) {
+	//Finds n sectors, starting in the cylinder with most free and
+	//carrying on into the next ones.  Returns the number of extents, 0
+	//if there isn't room in max of them.  Nothing is marked.
+	uint32_t s, f, most = 0, total = cyls * spc, scanned, c, best = first;
+	int k = 0;
+
+	for (c = first; c < cyls; c++)
+		if ((f = _cylfree(c)) > most) {
+			most = f;
+			best = c;
+		}
+	for (s = best * spc, scanned = 0; n && scanned < total; s = (s + 1) % total, scanned++) {
+		if (!_isfree(s))
+			continue;
+		if (k && start[k - 1] + count[k - 1] == s && count[k - 1] < 0xffff)
+			count[k - 1]++;
+		else if (k == max)
+			return 0;
+		else {
+			start[k] = s;
+			count[k++] = 1;
+		}
+		n--;
+	}
+	return n ? 0 : k;
+}
+
+static void _take(uint32_t *start, uint32_t *count, int k, int isfree) {
+	int i;
+	uint32_t s;
+
+	for (i = 0; i < k; i++)
+		for (s = start[i]; s < start[i] + count[i]; s++)
+			_mark(s, isfree);
+}
+
+// objects
+
+static int _obj(uint32_t sin, obj_t *o) {
+	//Reads the map of an object, 0 if it isn't one.
+	uint8_t *e;
+	uint32_t c;
+
+	o->sin = sin;
+	if (!(o->m = _sec(sin)) || memcmp(o->m, "JesMap", 6))
+		return 0;
+	o->sectors = 0;
+	for (o->n = 0; o->n < MAPEXTS; o->n++) {
+		e = o->m + MAPHEAD + o->n * 5;
+		if (!(c = _u16(e + 3)))
+			break;
+		if (_u24(e) + c > nsec)
+			return 0;
+		o->sectors += c;
+	}
+	o->size = o->sectors ? (o->sectors - 1) * SECSIZE + (o->m[8] ? o->m[8] : SECSIZE) : 0;
+	return 1;
+}
+
+static void _setsize(obj_t *o, uint32_t size) {
+	o->size = size;
+	o->m[8] = size;
+	o->m[MAPSEQ] = ++o->m[6];
+}
+
+static void _copy(obj_t *o, uint8_t *buf, uint32_t len, int write) {
+	//Between buf and the data of an object.
+	uint32_t off = 0, n;
+	uint8_t *e;
+	int i;
+
+	for (i = 0; i < o->n && off < len; i++) {
+		e = o->m + MAPHEAD + i * 5;
+		n = _u16(e + 3) * SECSIZE;
+		if (n > len - off)
+			n = len - off;
+		if (write) {
+			memcpy(_sec(_u24(e)), buf + off, n);
+			memset(_sec(_u24(e)) + n, 0, _u16(e + 3) * SECSIZE - n);
+		} else
+			memcpy(buf + off, _sec(_u24(e)), n);
+		off += n;
+	}
+}
+
+static int _create(uint32_t size, obj_t *o) {
+	//A new object of size bytes, 0 if there isn't room.
+	uint32_t start[MAPEXTS + 1], count[MAPEXTS + 1];
+	int k, i;
+
+	if (!(k = _alloc(1 + (size + SECSIZE - 1) / SECSIZE, start, count, MAPEXTS + 1)))
+		return 0;
+	if (k == MAPEXTS + 1 && count[0] > 1)
+		return 0;
+	_take(start, count, k, 0);
+	o->sin = start[0];
+	o->m = _sec(o->sin);
+	memset(o->m, 0, SECSIZE);
+	memcpy(o->m, "JesMap", 6);
+	//the map takes the first sector
+	start[0]++;
+	if (!--count[0]) {
+		memmove(start, start + 1, --k * sizeof(*start));
+		memmove(count, count + 1, k * sizeof(*count));
+	}
+	for (i = 0; i < k && size; i++) {
+		_put24(o->m + MAPHEAD + i * 5, start[i]);
+		_put16(o->m + MAPHEAD + i * 5 + 3, count[i]);
+	}
+	o->n = size ? k : 0;
+	o->sectors = (size + SECSIZE - 1) / SECSIZE;
+	_setsize(o, size);
+	return 1;
+}
+
+static int _extend(obj_t *o, uint32_t sectors) {
+	//Adds sectors to the end of an object, 0 if there isn't room.
+	uint32_t start[MAPEXTS], count[MAPEXTS];
+	uint8_t *e;
+	int k, i = 0;
+
+	if (o->n == MAPEXTS || !(k = _alloc(sectors, start, count, MAPEXTS - o->n)))
+		return 0;
+	_take(start, count, k, 0);
+	e = o->m + MAPHEAD + (o->n - 1) * 5;
+	if (o->n && _u24(e) + _u16(e + 3) == start[0] && _u16(e + 3) + count[0] <= 0xffff)
+		_put16(e + 3, _u16(e + 3) + count[i++]);
+	for (; i < k; i++, o->n++) {
+		_put24(o->m + MAPHEAD + o->n * 5, start[i]);
+		_put16(o->m + MAPHEAD + o->n * 5 + 3, count[i]);
+	}
+	o->sectors += sectors;
+	return 1;
+}
+
+static void _release(obj_t *o) {
+	//Frees the map and data of an object, leaving the map as the FS does.
+	uint8_t *e;
+	int i;
+	uint32_t s;
+
+	for (i = 0; i < o->n; i++) {
+		e = o->m + MAPHEAD + i * 5;
+		for (s = _u24(e); s < _u24(e) + _u16(e + 3); s++)
+			_mark(s, 1);
+	}
+	memset(o->m + MAPHEAD, 0, MAPEXTS * 5);
+	o->m[6] = 0;
+	_mark(o->sin, 1);
+}
+
+// directories
+
+static int _chain(uint8_t *d, uint32_t size, uint32_t head) {
+	//Every entry on the chain from head lies inside the directory, and
+	//it ends before it could have gone round a loop.  0 if not.
+	uint32_t e, n = 0, max = (size - DIRHEAD - 1) / ENTSIZE;
+
+	for (e = _u16(d + head); e; e = _u16(d + e + E_NEXT))
+		if (e < DIRHEAD || e + ENTSIZE > size - 1 || ++n > max)
+			return 0;
+	return 1;
+}
+
+static uint8_t *_dirload(uint32_t sin, obj_t *o) {
+	//A copy of a directory, NULL if it's broken.  The entries and free
+	//chains are checked here, so they can be followed without checks.
+	uint8_t *d;
+
+	if (!_obj(sin, o) || o->size < DIRHEAD + 1 || !(d = malloc(o->size)))
+		return NULL;
+	_copy(o, d, o->size, 0);
+	if (d[2] != d[o->size - 1] || !_chain(d, o->size, 0) || !_chain(d, o->size, 13)) {
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+static void _dirsave(obj_t *o, uint8_t *d) {
+	d[o->size - 1] = ++d[2];
+	_copy(o, d, o->size, 1);
+	free(d);
+}
+
+static void _dirname(uint8_t *p, char *name) {
+	int i;
+
+	for (i = 0; i < NAMELEN && p[i] > ' '; i++)
+		name[i] = p[i];
+	name[i] = 0;
+}
+
+static int _dircmp(uint8_t *p, char *name) {
+	//Case blind, as the FS sorts.
+	int i, a, b;
+
+	for (i = 0; i < NAMELEN; i++) {
+		a = toupper(p[i] > ' ' ? p[i] : ' ');
+		b = toupper(*name ? *name++ : ' ');
+		if (a != b)
+			return a - b;
+	}
+	return 0;
+}
+
+static uint32_t _find(uint8_t *d, char *name, uint32_t *prev) {
+	//The entry of name, 0 if it isn't there.
+	uint32_t p = _u16(d);
+
+	*prev = 0;
+	while (p && _dircmp(d + p + E_NAME, name) < 0) {
+		*prev = p;
+		p = _u16(d + p + E_NEXT);
+	}
+	return p && !_dircmp(d + p + E_NAME, name) ? p : 0;
+}
+
+static void _freelist(uint8_t *d, uint32_t from, uint32_t to) {
+	//Puts the entries from..to on the free list, the highest first.
+	uint32_t e;
+
+	for (e = from; e <= to; e += ENTSIZE) {
+		_put16(d + e + E_NEXT, _u16(d + 13));
+		_put16(d + 13, e);
+	}
+}
+
+static int _dirgrow(obj_t *o, uint8_t **dp) {
+	//Another sector of free entries, 0 if there isn't room.
+	uint32_t old = o->size, n, size;
+	uint8_t *d;
+
+	n = ((o->sectors + 1) * SECSIZE - DIRHEAD - 1) / ENTSIZE;
+	size = DIRHEAD + n * ENTSIZE + 1;
+	if (size > 0xffff || !_extend(o, 1))
+		return 0;
+	if (!(d = realloc(*dp, size))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(d + old - 1, 0, size - old + 1);
+	_freelist(d, old - 1, size - 1 - ENTSIZE);
+	_setsize(o, size);
+	*dp = d;
+	return 1;
+}
+
+static void _date(uint8_t *p) {
+	time_t t = time(NULL);
+	struct tm *tm = localtime(&t);
+	int y = tm->tm_year + 1900 - 1981;
+
+	p[0] = tm->tm_mday | (y >> 4) << 5;
+	p[1] = (tm->tm_mon + 1) | (y & 15) << 4;
+}
+
+static int _link(obj_t *o, uint8_t **dp, char *name, uint32_t load, uint32_t exec, int acc, uint32_t sin) {
+	//Adds an entry to a directory copy, 0 if it's full.
+	uint8_t *d, *p;
+	uint32_t e, prev;
+	int i, n = strlen(name);
+
+	if (!_u16(*dp + 13) && !_dirgrow(o, dp))
+		return 0;
+	d = *dp;
+	e = _u16(d + 13);
+	_put16(d + 13, _u16(d + e + E_NEXT));
+	p = d + e;
+	for (i = 0; i < NAMELEN; i++)
+		p[E_NAME + i] = i < n ? name[i] : ' ';
+	_put32(p + E_LOAD, load);
+	_put32(p + E_EXEC, exec);
+	p[E_ACC] = acc;
+	_date(p + E_DATE);
+	_put24(p + E_SIN, sin);
+	_find(d, name, &prev);
+	_put16(p + E_NEXT, _u16(d + prev));
+	_put16(d + prev, e);
+	_put16(d + 15, _u16(d + 15) + 1);
+	return 1;
+}
+
+static void _unlink(uint8_t *d, uint32_t e, uint32_t prev) {
+	_put16(d + prev, _u16(d + e + E_NEXT));
+	_put16(d + e + E_NEXT, _u16(d + 13));
+	_put16(d + 13, e);
+	_put16(d + 15, _u16(d + 15) - 1);
+}
+
+// paths and names
+
+static int _valid(char *name) {
+	//A name the FS would take.
+	int i;
+
+	if (!*name || strlen(name) > NAMELEN)
+		return 0;
+	for (i = 0; name[i]; i++)
+		if (name[i] < '!' || name[i] > '~' || strchr(BADCHARS, name[i]))
+			return 0;
+	return 1;
+}
+
+static void _swap(char *s, char from, char to) {
+	//Between host names and FS names, where / and . change places.
+	for (; *s; s++)
+		if (*s == from)
+			*s = to;
+		else if (*s == to)
+			*s = from;
+}
+
+static int _lookup(uint32_t dir, char *name, uint8_t *ent) {
+	//Copies the entry of name, 0 if it isn't there.
+	obj_t o;
+	uint8_t *d;
+	uint32_t e, prev;
+
+	if (!(d = _dirload(dir, &o)))
+		return 0;
+	if ((e = _find(d, name, &prev)))
+		memcpy(ent, d + e, ENTSIZE);
+	free(d);
+	return e != 0;
+}
+
+static int _walk(char *path, uint32_t *dir, char *leaf) {
+	//The directory path is in and its leaf name, 0 if a directory on the
+	//way isn't there.  The root itself has an empty leaf.
+	char buf[256], *p = buf, *dot;
+	uint8_t ent[ENTSIZE];
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	if (*p == '$')
+		p += p[1] == '.' ? 2 : 1;
+	*dir = root;
+	while ((dot = strchr(p, '.'))) {
+		*dot = 0;
+		if (!_lookup(*dir, p, ent) || !(ent[E_ACC] & ACC_D))
+			return 0;
+		*dir = _u24(ent + E_SIN);
+		p = dot + 1;
+	}
+	if (strlen(p) > NAMELEN)
+		return 0;
+	strcpy(leaf, p);
+	return 1;
+}
+
+static char *_access(int acc, char *s) {
+	char *p = s;
+
+	if (acc & ACC_D)
+		*p++ = 'D';
+	if (acc & ACC_L)
+		*p++ = 'L';
+	if (acc & ACC_W)
+		*p++ = 'W';
+	if (acc & ACC_R)
+		*p++ = 'R';
+	*p++ = '/';
+	if (acc & ACC_w)
+		*p++ = 'w';
+	if (acc & ACC_r)
+		*p++ = 'r';
+	*p = 0;
+	return s;
+}
+
+// commands
+
+static void _list(uint32_t dir, char *path) {
+	obj_t o;
+	uint8_t *d, *p;
+	uint32_t e;
+	char name[NAMELEN + 1], full[256], acc[8];
+
+	if (!(d = _dirload(dir, &o))) {
+		_fail("broken directory", *path ? path : "$");
+		return;
+	}
+	for (e = _u16(d); e; e = _u16(p + E_NEXT)) {
+		p = d + e;
+		_dirname(p + E_NAME, name);
+		snprintf(full, sizeof(full), "%s%s%s", path, *path ? "." : "", name);
+		printf("%-10s %08X %08X ", full, _u32(p + E_LOAD), _u32(p + E_EXEC));
+		if (_obj(_u24(p + E_SIN), &o))
+			printf("%06X", o.size);
+		else
+			printf("??????");
+		printf(" %-7s %02d/%02d/%02d %06X\n", _access(p[E_ACC], acc), p[E_DATE] & 0x1f, p[E_DATE + 1] & 0x0f,
+			(((p[E_DATE] >> 5) << 4 | p[E_DATE + 1] >> 4) + 81) % 100, _u24(p + E_SIN));
+		if (recurse && p[E_ACC] & ACC_D)
+			_list(_u24(p + E_SIN), full);
+	}
+	free(d);
+}
+
+static void _get(uint8_t *ent, char *to) {
+	//Extracts a file, with its addresses in to.inf, or a directory.
+	obj_t o;
+	uint8_t *d, *p;
+	uint32_t e;
+	char name[NAMELEN + 1], sub[4096];
+	FILE *f;
+
+	_dirname(ent + E_NAME, name);
+	if (ent[E_ACC] & ACC_D) {
+		if (mkdir(to, 0755) && errno != EEXIST) {
+			_fail(strerror(errno), to);
+			return;
+		}
+		if (!(d = _dirload(_u24(ent + E_SIN), &o))) {
+			_fail("broken directory", name);
+			return;
+		}
+		for (e = _u16(d); e; e = _u16(p + E_NEXT)) {
+			p = d + e;
+			_dirname(p + E_NAME, name);
+			_swap(name, '/', '.');
+			snprintf(sub, sizeof(sub), "%s/%s", to, name);
+			_get(p, sub);
+		}
+		free(d);
+		return;
+	}
+	if (!_obj(_u24(ent + E_SIN), &o) || !(d = malloc(o.size + 1))) {
+		_fail("broken map", name);
+		return;
+	}
+	_copy(&o, d, o.size, 0);
+	if (!(f = fopen(to, "wb")) || fwrite(d, 1, o.size, f) != o.size)
+		_fail(strerror(errno), to);
+	if (f)
+		fclose(f);
+	free(d);
+	snprintf(sub, sizeof(sub), "%s.inf", to);
+	if ((f = fopen(sub, "w"))) {
+		fprintf(f, "%s %08X %08X %06X %02X\n", name, _u32(ent + E_LOAD), _u32(ent + E_EXEC), o.size, ent[E_ACC]);
+		fclose(f);
+	}
+}
+
+static int _remove(uint32_t dir, char *name) {
+	//Deletes a file, or a directory and all in it.  0 if it couldn't.
+	obj_t o;
+	uint8_t *d, ent[ENTSIZE];
+	uint32_t e, prev, sin;
+	char sub[NAMELEN + 1];
+
+	if (!_lookup(dir, name, ent)) {
+		_fail("not found", name);
+		return 0;
+	}
+	sin = _u24(ent + E_SIN);
+	while (ent[E_ACC] & ACC_D) {
+		if (!(d = _dirload(sin, &o))) {
+			_fail("broken directory", name);
+			return 0;
+		}
+		e = _u16(d);
+		if (e)
+			_dirname(d + e + E_NAME, sub);
+		free(d);
+		if (!e)
+			break;
+		if (!_remove(sin, sub))
+			return 0;
+	}
+	if (!(d = _dirload(dir, &o)) || !(e = _find(d, name, &prev))) {
+		free(d);
+		_fail("broken directory", name);
+		return 0;
+	}
+	_unlink(d, e, prev);
+	_dirsave(&o, d);
+	if (_obj(sin, &o))
+		_release(&o);
+	return 1;
+}
+
+static int _newdir(char *name, uint32_t parent, uint32_t *sin) {
+	//An empty directory as FS 1.26 makes them, 0 if there isn't room.
+	obj_t o;
+	uint8_t d[DIRNEWSIZE];
+	int i;
+
+	if (!_create(DIRNEWSIZE, &o))
+		return 0;
+	memset(d, 0, sizeof(d));
+	for (i = 0; i < NAMELEN; i++)
+		d[3 + i] = *name ? *name++ : ' ';
+	//the first entry isn't used, it points back at the parent
+	_put16(d + DIRHEAD + E_NEXT, 0xffff);
+	_put24(d + DIRHEAD + E_SIN, parent);
+	_freelist(d, DIRHEAD + ENTSIZE, DIRNEWSIZE - 1 - ENTSIZE);
+	_copy(&o, d, DIRNEWSIZE, 1);
+	*sin = o.sin;
+	return 1;
+}
+
+static void _put(char *from, uint32_t dir) {
+	//Imports a file or, with all in it, a directory.
+	struct stat st;
+	struct dirent **list;
+	obj_t o, dobj;
+	uint8_t *d, *buf;
+	uint32_t e, prev, sin = 0, load = 0, exec = 0;
+	int acc = ACC_FILE, n, i;
+	char name[256], sub[4096], *base;
+	FILE *f;
+
+	snprintf(sub, sizeof(sub), "%s", from);
+	for (n = strlen(sub); n > 1 && sub[n - 1] == '/'; )
+		sub[--n] = 0;
+	base = strrchr(sub, '/') ? strrchr(sub, '/') + 1 : sub;
+	snprintf(name, sizeof(name), "%.*s", NAMELEN + 1, base);//too long for _valid either way
+	_swap(name, '.', '/');
+	if (stat(from, &st)) {
+		_fail(strerror(errno), from);
+		return;
+	}
+	//addresses kept beside a file
+	if ((n = strlen(sub)) > 4 && !strcmp(sub + n - 4, ".inf")) {
+		sub[n - 4] = 0;
+		if (!access(sub, F_OK))
+			return;
+	}
+	if (!_valid(name)) {
+		_fail("not a valid name", from);
+		return;
+	}
+	if (!(d = _dirload(dir, &dobj))) {
+		_fail("broken directory", from);
+		return;
+	}
+	e = _find(d, name, &prev);
+	if (S_ISDIR(st.st_mode)) {
+		if (e && !(d[e + E_ACC] & ACC_D)) {
+			free(d);
+			_fail("already a file", from);
+			return;
+		}
+		if (e)
+			sin = _u24(d + e + E_SIN);
+		else if (!_newdir(name, dir, &sin) || !_link(&dobj, &d, name, 0, 0, ACC_DIR, sin)) {
+			if (sin && _obj(sin, &o))//made but couldn't be linked
+				_release(&o);
+			free(d);
+			_fail("disc full", from);
+			return;
+		}
+		_dirsave(&dobj, d);
+		if ((n = scandir(from, &list, NULL, alphasort)) < 0) {
+			_fail(strerror(errno), from);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			if (strcmp(list[i]->d_name, ".") && strcmp(list[i]->d_name, "..")) {
+				snprintf(sub, sizeof(sub), "%s/%s", from, list[i]->d_name);
+				_put(sub, sin);
+			}
+			free(list[i]);
+		}
+		free(list);
+		return;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size > MAXSIZE) {
+		free(d);
+		_fail("not a file that will fit", from);
+		return;
+	}
+	if (e && d[e + E_ACC] & ACC_D) {
+		free(d);
+		_fail("already a directory", from);
+		return;
+	}
+	snprintf(sub, sizeof(sub), "%s.inf", from);
+	if ((f = fopen(sub, "r"))) {
+		if (fscanf(f, "%*s %x %x %*x %x", &load, &exec, &acc) < 3)
+			acc = ACC_FILE;
+		fclose(f);
+	}
+	if (!(buf = malloc(st.st_size + 1)) || !(f = fopen(from, "rb")) || fread(buf, 1, st.st_size, f) != (size_t) st.st_size) {
+		free(buf);
+		free(d);
+		_fail(strerror(errno), from);
+		return;
+	}
+	fclose(f);
+	//the new one is made before any old one goes, so a full disc loses nothing
+	if (!_create(st.st_size, &o)) {
+		free(buf);
+		free(d);
+		_fail("disc full", from);
+		return;
+	}
+	_copy(&o, buf, st.st_size, 1);
+	free(buf);
+	if (e) {//replaced, as a save would
+		sin = _u24(d + e + E_SIN);
+		_unlink(d, e, prev);
+	}
+	if (!_link(&dobj, &d, name, load, exec, acc & ~ACC_D, o.sin)) {
+		_release(&o);
+		free(d);
+		_fail("disc full", from);
+		return;
+	}
+	_dirsave(&dobj, d);
+	if (e && _obj(sin, &o))
+		_release(&o);
+}
+
+static void _info(char *path) {
+	uint8_t *a = _sec(_u24(img + 0xf6));
+	uint32_t s, nfree = 0;
+
+	for (s = first * spc; s < cyls * spc; s++)
+		nfree += _isfree(s) != 0;
+	printf("%s: '%.16s' %d cylinders of %u sectors, %ld in the image, %u free, root %06X\n",
+		path, a + 4, _u16(a + 0x14), spc, nsec, nfree, root);
+}
+
+static void _owned(uint32_t sin, char *name, uint32_t *bad, uint8_t *found, uint32_t nbad) {
+	//Names the bad sectors in an object.
+	obj_t o;
+	uint8_t *e;
+	uint32_t i, off;
+	int k;
+
+	if (!_obj(sin, &o))
+		return;
+	for (i = 0; i < nbad; i++) {
+		if (bad[i] == sin) {
+			printf("%06X %s (map)\n", bad[i], name);
+			found[i] = 1;
+		}
+		for (k = 0, off = 0; k < o.n; off += _u16(e + 3), k++) {
+			e = o.m + MAPHEAD + k * 5;
+			if (bad[i] >= _u24(e) && bad[i] < _u24(e) + _u16(e + 3)) {
+				printf("%06X %s (bytes %06X on)\n", bad[i], name, (off + bad[i] - _u24(e)) * SECSIZE);
+				found[i] = 1;
+			}
+		}
+	}
+}
+
+static void _owners(uint32_t dir, char *path, uint32_t *bad, uint8_t *found, uint32_t nbad) {
+	obj_t o;
+	uint8_t *d, *p;
+	uint32_t e;
+	char name[NAMELEN + 1], full[256];
+
+	if (!(d = _dirload(dir, &o))) {
+		printf("%s: broken directory\n", path);
+		return;
+	}
+	for (e = _u16(d); e; e = _u16(p + E_NEXT)) {
+		p = d + e;
+		_dirname(p + E_NAME, name);
+		snprintf(full, sizeof(full), "%s.%s", path, name);
+		_owned(_u24(p + E_SIN), full, bad, found, nbad);
+		if (p[E_ACC] & ACC_D)
+			_owners(_u24(p + E_SIN), full, bad, found, nbad);
+	}
+	free(d);
+}
+
+static void _scrub(char *path) {
+	uint32_t bad[SCRUBMAX], n, i, s;
+	uint8_t found[SCRUBMAX] = {0};
+
+	if (sumfd < 0) {
+		fprintf(stderr, "%s: no checksums, run the server with -c on\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (stale) {
+		fprintf(stderr, "%s: checksums out of date, the server remakes them when it next starts\n", path);
+		exit(EXIT_FAILURE);
+	}
+	n = _badsectors(bad, SCRUBMAX);
+	for (i = 0; i < n && i < SCRUBMAX; i++) {
+		s = bad[i];
+		if (s < 2 || s == _u24(img + 0xf6) || s == _u24(img + SECSIZE + 0xf6))
+			printf("%06X disc header\n", s);
+		else if (!(s % spc) && s / spc >= first)
+			printf("%06X bitmap of cylinder %u\n", s, s / spc);
+		else
+			continue;
+		found[i] = 1;
+	}
+	_owned(root, "$", bad, found, n < SCRUBMAX ? n : SCRUBMAX);
+	_owners(root, "$", bad, found, n < SCRUBMAX ? n : SCRUBMAX);
+	for (i = 0; i < n && i < SCRUBMAX; i++)
+		if (!found[i])
+			printf("%06X not in use\n", bad[i]);
+	printf("%s: %u sectors checked with %s, %u bad\n", path, nsums, crc32c_impl(), n);
+	if (n)
+		errors++;
+}
+
+static void _usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-r] image info | scrub | ls [dir] | get path [to] | put from... dir | mkdir dir... | rm path...\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	char *image, *cmd, leaf[NAMELEN + 1], to[256];
+	uint8_t ent[ENTSIZE];
+	uint32_t dir, sin;
+	obj_t o;
+	uint8_t *d;
+	int opt, n, i;
+
+	while ((opt = getopt(argc, argv, "r")) != -1) {
+		switch (opt) {
+			case 'r':
+				recurse = 1;
+				break;
+			default:
+				_usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		_usage(argv[0]);
+	image = argv[optind];
+	cmd = argv[optind + 1];
+	argv += optind + 2;
+	n = argc - optind - 2;
+
+	if (!strcmp(cmd, "info") && !n) {
+		_open(image, 0);
+		_info(image);
+	} else if (!strcmp(cmd, "scrub") && !n) {
+		_open(image, 0);
+		_scrub(image);
+	} else if (!strcmp(cmd, "ls") && n <= 1) {
+		_open(image, 0);
+		if (!_walk(n ? argv[0] : "$", &dir, leaf) || (*leaf && (!_lookup(dir, leaf, ent) || !(ent[E_ACC] & ACC_D)))) {
+			fprintf(stderr, "%s: not a directory\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (*leaf)
+			dir = _u24(ent + E_SIN);
+		_list(dir, "");
+	} else if (!strcmp(cmd, "get") && (n == 1 || n == 2)) {
+		_open(image, 0);
+		if (!_walk(argv[0], &dir, leaf) || !*leaf || !_lookup(dir, leaf, ent)) {
+			fprintf(stderr, "%s: not found\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		_dirname(ent + E_NAME, leaf);
+		_swap(leaf, '/', '.');
+		snprintf(to, sizeof(to), "%s", n == 2 ? argv[1] : leaf);
+		_get(ent, to);
+	} else if (!strcmp(cmd, "put") && n >= 2) {
+		_open(image, 1);
+		if (!_walk(argv[n - 1], &dir, leaf) || (*leaf && (!_lookup(dir, leaf, ent) || !(ent[E_ACC] & ACC_D)))) {
+			fprintf(stderr, "%s: not a directory\n", argv[n - 1]);
+			exit(EXIT_FAILURE);
+		}
+		if (*leaf)
+			dir = _u24(ent + E_SIN);
+		for (i = 0; i < n - 1; i++)
+			_put(argv[i], dir);
+		_close();
+	} else if (!strcmp(cmd, "mkdir") && n) {
+		_open(image, 1);
+		for (i = 0; i < n; i++) {
+			if (!_walk(argv[i], &dir, leaf) || !_valid(leaf)) {
+				_fail("bad path", argv[i]);
+				continue;
+			}
+			if (_lookup(dir, leaf, ent)) {
+				_fail("already exists", argv[i]);
+				continue;
+			}
+			if (!(d = _dirload(dir, &o))) {
+				_fail("broken directory", argv[i]);
+				continue;
+			}
+			if (!_newdir(leaf, dir, &sin)) {
+				free(d);
+				_fail("disc full", argv[i]);
+			} else if (!_link(&o, &d, leaf, 0, 0, ACC_DIR, sin)) {
+				free(d);
+				if (_obj(sin, &o))
+					_release(&o);
+				_fail("disc full", argv[i]);
+			} else
+				_dirsave(&o, d);
+		}
+		_close();
+	} else if (!strcmp(cmd, "rm") && n) {
+		_open(image, 1);
+		for (i = 0; i < n; i++) {
+			if (!_walk(argv[i], &dir, leaf) || !*leaf)
+				_fail("bad path", argv[i]);
+			else
+				_remove(dir, leaf);
+		}
+		_close();
+	} else
+		_usage(argv[0]);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,250 @@
+/* File Server Emulator   */
+/* log.c                  */
+/* (c) 2021 Martin Mather */
+
+/* Messages from any thread are put in a lock-free ring of fixed size */
+/* slots and written out by a thread of their own, to the console, a  */
+/* file or syslog, so a slow terminal never holds up the emulator.     */
+/* If the ring is full the message is dropped and counted.  Each       */
+/* category has its own level, messages above it are ignored.  Errors  */
+/* are waited for, they're often the last thing before exit().          */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "log.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELEASE)
+
+struct lslot_t {
+	unsigned seq;//which turn of the ring the slot is ready for
+	uint8_t cat, level;
+	uint16_t len;
+	char text[LOG_MSGLEN];
+};
+
+static const char *catnames[LOGC_COUNT] = {"FS", "FSEM", "AUN", "DISC"};
+static const char *levelnames[] = {"error", "warn", "info", "debug"};
+static const int priorities[] = {LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG};
+
+static int levels[LOGC_COUNT] = {LOGL_INFO, LOGL_INFO, LOGL_INFO, LOGL_INFO};
+static struct lslot_t *slots;
+static unsigned enq, deq;
+static uint64_t messages, dropped;
+static int running, tosyslog;
+static FILE *out;
+static pthread_t writer;
+
+static char line[LOG_MSGLEN];//what the FS has printed so far, emulator thread only
+static int linelen;
+
+static struct lslot_t *_claim(void) {
+	unsigned pos = __atomic_load_n(&enq, __ATOMIC_RELAXED);
+
+	for (;;) {
+		struct lslot_t *s = &slots[pos & (LOG_SLOTS - 1)];
+		int diff = (int) (LOAD(s->seq) - pos);
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&enq, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return s;
+		} else if (diff < 0) {//full
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else
+			pos = __atomic_load_n(&enq, __ATOMIC_RELAXED);
+	}
+}
+
+static void _publish(struct lslot_t *s) {
+	unsigned pos = s->seq;//still as claimed
+
+	__atomic_add_fetch(&messages, 1, __ATOMIC_RELAXED);
+	STORE(s->seq, pos + 1);
+}
+
+static void _write(struct lslot_t *s) {
+	if (tosyslog) {//one line each, without the line ends
+		char *text = s->text;
+		int len = s->len;
+
+		while (len && (*text == '\n' || *text == '\r')) {
+			text++;
+			len--;
+		}
+		while (len && (text[len - 1] == '\n' || text[len - 1] == '\r'))
+			len--;
+		if (len && s->cat == LOGC_FS)
+			syslog(priorities[s->level], "%.*s", len, text);
+		else if (len)
+			syslog(priorities[s->level], "%s:%.*s", catnames[s->cat], len, text);
+	} else if (s->cat == LOGC_FS)
+		fwrite(s->text, 1, s->len, out);
+	else
+		fprintf(out, "%s:%.*s\n", catnames[s->cat], s->len, s->text);
+}
+
+static void *_writer(void *arg) {
+	struct timespec idle = {0, 10 * 1000000};//ms
+
+	for (;;) {
+		struct lslot_t *s = &slots[deq & (LOG_SLOTS - 1)];
+
+		if (LOAD(s->seq) != deq + 1) {//nothing ready
+			if (out)
+				fflush(out);
+			if (!LOAD(running))
+				return NULL;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		_write(s);
+		if (s->level == LOGL_ERROR && out)
+			fflush(out);//before log_msg returns
+		STORE(s->seq, deq + LOG_SLOTS);
+		STORE(deq, deq + 1);
+	}
+}
+
+int log_open(char *dest) {
+	//dest is "console", "file:path" or "syslog"
+	if (!(slots = malloc(LOG_SLOTS * sizeof(struct lslot_t))))
+		return 0;
+	for (unsigned i = 0; i < LOG_SLOTS; i++)
+		slots[i].seq = i;
+
+	if (!dest || !strcmp(dest, "console"))
+		out = stdout;
+	else if (!strncmp(dest, "file:", 5)) {
+		if (!(out = fopen(dest + 5, "a"))) {
+			printf("LOG:Couldn't open '%s'\n", dest + 5);
+			out = stdout;
+		}
+	} else if (!strcmp(dest, "syslog")) {
+		openlog("fsem", LOG_PID, LOG_DAEMON);
+		tosyslog = 1;
+	} else {
+		printf("LOG:Unknown destination '%s'\n", dest);
+		out = stdout;
+	}
+
+	running = 1;
+	if (pthread_create(&writer, NULL, _writer, NULL)) {
+		running = 0;
+		free(slots);
+		slots = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+int log_levels(char *spec) {
+	//[category=]level,...  eg "debug" or "aun=debug,fs=warn".  0 if no good.
+	char buf[128], *item;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+		char *lv = strchr(item, '=');
+		int cat = -1, level;
+
+		if (lv) {
+			*lv++ = 0;
+			for (cat = 0; cat < LOGC_COUNT && strcasecmp(item, catnames[cat]); cat++)
+				;
+			if (cat == LOGC_COUNT)
+				return 0;
+		} else
+			lv = item;
+
+		for (level = LOGL_ERROR; level <= LOGL_DEBUG && strcmp(lv, levelnames[level]); level++)
+			;
+		if (level > LOGL_DEBUG)
+			return 0;
+
+		for (int c = 0; c < LOGC_COUNT; c++)
+			if (cat < 0 || c == cat)
+				levels[c] = level;
+	}
+	return 1;
+}
+
+void log_msg(int cat, int level, const char *fmt, ...) {
+	struct lslot_t *s;
+	va_list ap;
+
+	if (level > levels[cat])
+		return;
+
+	va_start(ap, fmt);
+	if (!LOAD(running)) {//not started, or finished
+		if (cat != LOGC_FS)
+			printf("%s:", catnames[cat]);
+		vprintf(fmt, ap);
+		if (cat != LOGC_FS)
+			printf("\n");
+	} else if ((s = _claim())) {
+		int len = vsnprintf(s->text, LOG_MSGLEN, fmt, ap);
+		unsigned pos = s->seq;
+
+		s->len = (len < 0) ? 0 : (len >= LOG_MSGLEN) ? LOG_MSGLEN - 1 : len;
+		s->cat = cat;
+		s->level = level;
+		_publish(s);
+		if (level == LOGL_ERROR) {//wait until it's out
+			struct timespec wait = {0, 1000000};//ms
+
+			while ((int) (LOAD(deq) - pos) <= 0 && LOAD(running))
+				nanosleep(&wait, NULL);
+		}
+	} else if (level == LOGL_ERROR) {//ring full, don't lose it
+		fprintf(stderr, "%s:", catnames[cat]);
+		vfprintf(stderr, fmt, ap);
+		fprintf(stderr, "\n");
+	}
+	va_end(ap);
+}
+
+void log_putc(char c) {
+	//Characters printed by the file server, passed on a line at a time.
+	line[linelen++] = c;
+	if (c == '\n' || linelen == LOG_MSGLEN - 1)
+		log_flush();
+}
+
+void log_flush(void) {
+	//Pass on what the file server has printed, even without a newline.
+	if (linelen)
+		log_msg(LOGC_FS, LOGL_INFO, "%.*s", linelen, line);
+	linelen = 0;
+}
+
+void log_stats(void) {
+	printf("LOG:messages=%llu dropped=%llu\n",
+		(unsigned long long) LOAD(messages), (unsigned long long) LOAD(dropped));
+}
+
+void log_close(void) {
+	if (!slots)
+		return;
+	log_flush();
+	STORE(running, 0);
+	pthread_join(writer, NULL);
+	if (LOAD(dropped))
+		log_stats();
+	if (tosyslog)
+		closelog();
+	else if (out && out != stdout)
+		fclose(out);
+	free(slots);
+	slots = NULL;
+}
@@ -0,0 +1,25 @@
+/* File Server Emulator   */
+/* log.h                  */
+/* (c) 2021 Martin Mather */
+
+#define LOG_SLOTS	1024	// messages buffered for the writer, power of 2
+#define LOG_MSGLEN	128	// longest message, longer ones are cut short
+
+#define LOGL_ERROR	0
+#define LOGL_WARN	1
+#define LOGL_INFO	2
+#define LOGL_DEBUG	3
+
+#define LOGC_FS	0	// what the file server prints, passed on as is
+#define LOGC_FSEM	1
+#define LOGC_AUN	2
+#define LOGC_DISC	3
+#define LOGC_COUNT	4
+
+int log_open(char *dest);
+int log_levels(char *spec);
+void log_msg(int cat, int level, const char *fmt, ...);
+void log_putc(char c);
+void log_flush(void);
+void log_stats(void);
+void log_close(void);
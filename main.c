@@ -1,200 +1,489 @@
-/* File Server Emulator   */
-/* main.c                 */
-/* (c) 2021 Martin Mather */
-
-/* 17/09/21, some changes made to make it run in Cygwin64 */
-
-#define _POSIX_C_SOURCE 1
-
-#include <ctype.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <termios.h>
-#include <sys/ioctl.h>
-#include <unistd.h>	//sleep()
-#include <time.h>
-#include <sys/socket.h> //for Cygwin
-#include <getopt.h>
-#include <arpa/inet.h>
-
-#include "aun.h"
-#include "ebuf.h"
-#include "fsem.h"
-
-void set_no_buffer() {
-	struct termios term;
-	tcgetattr(0, &term);
-	term.c_lflag &= ~ICANON;
-	tcsetattr(0, TCSANOW, &term);
-}
-
-int charsWaiting(int fd) {
-	int count;
-	
-	if (ioctl(fd, FIONREAD, &count) == -1)
-		exit (EXIT_FAILURE);
-	
-	return count;
-}
-
-int main(int argc, char *argv[]) {
-	char c, skey;
-	int ex = 0, rx = 0, tx = 0, loops = 0, rc, txcount = 0;
-	int rxto, flg, txretry;
-	time_t timeout1;
-	int my_stn=254;
-	in_addr_t listen_addr=INADDR_ANY;
-	struct in_addr inp;
-	int opt;
-
-	while ((opt = getopt(argc, argv, "s:a:")) != -1) {
-		switch (opt) {
-			case 's':
-				my_stn = atoi(optarg);
-				break;
-			case 'a':
-				opt=inet_pton(AF_INET,optarg,&inp);
-				listen_addr=inp.s_addr;
-				break;
-			default:
-				fprintf(stderr, "Usage: %s [-s stn_id] [-a ip.address.]\n",argv[0]);
-				exit(EXIT_FAILURE);
-		}
-	}
-
-	printf("File Server Emulator\n\n");
-
-	if (fsem_open("$.FS", 0x0400, my_stn, "scsi1.dat")) {
-		aun_open(my_stn,listen_addr);
-	
-		set_no_buffer();
-		do {
-			loops++;
-			flg = 0;
-
-			//printf("P %d\n", loops);
-				
-			if (!ex) {
-				rc = fsem_exec(1, 0);//Execute
-				//printf("RC=%d\n", rc);
-				ex = 1;
-				switch (rc) {
-					case FSEM_WAIT0://no timeout, allow key press
-						rx = 1;
-						rxto = 0;
-						break;
-					case FSEM_WAIT2://60 second timeout
-						rx = 2;
-						rxto = 60;
-						break;
-					case FSEM_SEND:
-						tx = 1;
-						txretry = 0;
-						txcount=10;//number of tx attempts
-						break;
-					default:
-						rx = 0;
-						ex = 0;
-						break;
-				}
-			}
-				
-			if (tx > 0) {
-				aun_transmitter(txretry++);
-				tx = -1;
-				rx = 1;//wait for ACK
-				rxto = 1;//timeout seconds
-			}
-			
-			if (rxto > 0) {//Set timeout
-				//printf("SET TIMEOUT TO %d SECONDS\n", rxto);
-				timeout1 = time(0) + rxto;
-				rxto = -1;
-			}
-			
-			skey = 0;
-			c = 0;
-			int count = charsWaiting(fileno(stdin));
-			if (count != 0) {
-				c = tolower(getchar());
-				switch (c) {
-					case 'q':
-						printf("Quit\n");
-						break;
-					case 'x':
-						printf("Enable exec\n");
-						ex = 0;
-						rx = 1;
-						break;
-					case 'z':
-						printf("Disable exec\n");
-						ex = 1;
-						break;
-					case 'm'://monitor on/off
-						skey = 'M';
-						break;
-					case 'r'://restart
-						skey = 'Q';
-						break;
-				}
-			}
-			
-			if (rxto < 0) {//Check for timeout
-				if (time(0) >= timeout1) {
-					//printf("RX TIMEOUT\n");
-					
-					if (tx < 0) {//retry tx?
-						if (--txcount)
-							tx = 1;
-						else//tx failed
-							flg = 4;
-					} else
-						flg = 1;
-				}
-			}
-			
-			if (skey && rx != 2) {
-				//printf("SKEY!\n");
-				fsem_sendkey(1, skey);
-				flg = 1;
-			}
-			
-			if (rx) {//Check receiver
-				if (aun_receiver(tx)) {
-					if (tx < 0)
-						flg = 3;//Acked
-					else
-						flg = 2;//We've got something
-				}
-			}
-			
-			if (flg) {
-				//printf("FLAG = %d\n", flg);
-				//flag set means return to emulator
-				//flg==1 : timeout or key pressed, X=0x00
-				//flg==2 : data received, X=0x80
-				//flg==3 : transmission succeeded (ACK received)
-				//flg==4 : transmission failed
-				if (flg == 1)
-					fsem_loadX(0x00);
-				else if (flg == 2)
-					fsem_loadX(0x80);
-				else if (flg == 3)
-					fsem_loadA(0x00);
-				else
-					fsem_loadA(0x40);//generic error
-				
-				tx = 0;//disable transmitter
-				rx = 0;//disable receiver
-				ex = 0;//enable execution
-				rxto = 0;//stop timer
-				ebuf_listen(0);//stop listening
-			}
-
-		} while (c != 'q');
-	
-		aun_close();
-		fsem_close();
-	}
-}
+/* File Server Emulator   */
+/* main.c                 */
+/* (c) 2021 Martin Mather */
+
+/* 17/09/21, some changes made to make it run in Cygwin64 */
+
+#define _POSIX_C_SOURCE 1
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <unistd.h>	//sleep()
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h> //for Cygwin
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "aun.h"
+#include "ebuf.h"
+#include "fsem.h"
+#include "tick.h"
+#include "imm.h"
+#include "sched.h"
+#include "impair.h"
+#include "fsop.h"
+#include "pcap.h"
+#include "log.h"
+#include "scsistat.h"
+#include "disc.h"
+#include "rt.h"
+#include "ctl.h"
+
+#define RXPOLL_MS	333	//longest we block in the receiver before checking keys
+#define BENCH_TIMEOUT	60	//seconds, for the boot benchmark to reach ready
+
+static volatile sig_atomic_t backupsig;
+
+static void _sigbackup(int sig) {
+	backupsig = 1;
+}
+
+void set_no_buffer() {
+	struct termios term;
+	tcgetattr(0, &term);
+	term.c_lflag &= ~ICANON;
+	tcsetattr(0, TCSANOW, &term);
+}
+
+int charsWaiting(int fd) {
+	int count;
+	
+	if (ioctl(fd, FIONREAD, &count) == -1)
+		exit (EXIT_FAILURE);
+	
+	return count;
+}
+
+static int _bootbench(char *fsname, char *disc, uint16_t stn, int buffers, char *report) {
+	//Time the file server from loading to first waiting for a request,
+	//with no terminal or network, and write the results as JSON.
+	uint64_t start = tick_us(), loaded, ready, sectors;
+	int rc = FSEM_BREAK, slices = 0;
+	FILE *f = stdout;
+
+	if (!fsem_open(fsname, 0x0400, stn, disc))
+		return EXIT_FAILURE;
+	loaded = tick_us();
+	ebuf_open(buffers);
+
+	while (tick_us() - loaded < BENCH_TIMEOUT * 1000000ull) {
+		rc = fsem_exec(1, 0);
+		slices++;
+		if (rc == FSEM_WAIT0 || rc == FSEM_BREAK)
+			break;
+		if (rc == FSEM_WAIT1 || rc == FSEM_WAIT2)
+			fsem_loadX(0x00);//as if it timed out
+		else if (rc == FSEM_SEND)
+			fsem_loadA(0x40);//nobody to send to
+	}
+	ready = tick_us();
+
+	if (strcmp(report, "-") && !(f = fopen(report, "w"))) {
+		printf("Couldn't write '%s'\n", report);
+		f = stdout;
+	}
+	fprintf(f, "{\"fs\":");
+	ctl_jsonstr(f, fsname);
+	fprintf(f, ",\"disc\":");
+	ctl_jsonstr(f, disc);
+	fprintf(f, ",\"ready\":%s,\"state\":%d,\"load_us\":%llu,\"boot_us\":%llu,\"total_us\":%llu,"
+		"\"slices\":%d,\"instructions\":%llu,\"scsi_ops\":%llu,\"scsi_reads\":%llu,",
+		rc == FSEM_WAIT0 ? "true" : "false", rc,
+		(unsigned long long) (loaded - start), (unsigned long long) (ready - loaded),
+		(unsigned long long) (ready - start), slices, (unsigned long long) fsem_instructions(),
+		(unsigned long long) fsem_scsiops(), (unsigned long long) fsem_scsireads(&sectors));
+	fprintf(f, "\"sectors_read\":%llu}\n", (unsigned long long) sectors);
+	if (f != stdout)
+		fclose(f);
+
+	ebuf_close();
+	fsem_close();
+	return rc == FSEM_WAIT0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+	char c, skey;
+	int ex = 0, rx = 0, tx = 0, loops = 0, rc;
+	int rxto, flg;
+	uint32_t timeout1;
+	unsigned txseq = 0;//the FS's latest transmission
+	int buffers = AUN_MAX_BUFFERS;
+	int txlimit = AUN_TX_RETRIES, backoff = 0;
+	int my_stn=254;
+	char *listen[AUN_MAX_LISTENERS];
+	int nlisten = 0;
+	struct in_addr inp;
+	int opt;
+	char *mapfile = NULL, *pcapfile = NULL, *bench = NULL;
+	char *fsname = "$.FS", *disc = "scsi1.dat", *logdest = "console", *backup = NULL;
+	int pcapmb = 0, pcapfiles = 0;
+	unsigned mtype = IMM_MACHINE, mver = IMM_VERSION;
+
+	while ((opt = getopt(argc, argv, "s:a:r:t:b:m:M:n:l:T:W:I:o:C:P:f:d:A:B:L:V:S:k:j:K:N:R:c:")) != -1) {
+		switch (opt) {
+			case 's':
+				my_stn = atoi(optarg);
+				break;
+			case 'a': {//RISC OS style listener, same as -l riscos:ip.address
+				char *spec = malloc(strlen(optarg) + 8);
+
+				if (inet_pton(AF_INET, optarg, &inp) != 1 || !spec) {
+					fprintf(stderr, "Bad address '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				sprintf(spec, "riscos:%s", optarg);//kept until exit
+				if (nlisten < AUN_MAX_LISTENERS)
+					listen[nlisten++] = spec;
+				break;
+			}
+			case 'l':
+				if (nlisten < AUN_MAX_LISTENERS)
+					listen[nlisten++] = optarg;
+				break;
+			case 'T'://drop queued requests older than this
+				sched_maxage(atoi(optarg));
+				break;
+			case 'W': {//net.stn:weight or stn:weight
+				unsigned net = 0, stn, weight;
+				if (sscanf(optarg, "%u.%u:%u", &net, &stn, &weight) == 3
+						|| (net = 0, sscanf(optarg, "%u:%u", &stn, &weight) == 2))
+					sched_weight(AUN_ADDR(net & 0x7f, stn & 0xff), weight);
+				break;
+			}
+			case 'I'://network impairment
+				if (!impair_config(optarg)) {
+					fprintf(stderr, "Bad impairment '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'o': {//file[:secs], export per-operation stats
+				char *c = strrchr(optarg, ':');
+				int secs = 60;
+				if (c) {
+					*c++ = 0;
+					secs = atoi(c);
+				}
+				fsop_export(optarg, secs > 0 ? secs : 60);
+				break;
+			}
+			case 'C'://control socket
+				aun_control(optarg);
+				break;
+			case 'P': {//file[:mb[:files]], capture
+				int mb = 0, files = 0;
+				char *c = strrchr(optarg, ':');//the file name may have colons
+				if (c) {//take the numbers off the end
+					char *c2;
+					*c = 0;
+					c2 = strrchr(optarg, ':');
+					if (c2 && sscanf(c2 + 1, "%d", &mb) == 1) {
+						*c2 = 0;
+						files = atoi(c + 1);
+					} else if (sscanf(c + 1, "%d", &mb) != 1)
+						*c = ':';//not a number, part of the name
+				}
+				pcapfile = optarg;
+				pcapmb = mb;
+				pcapfiles = files;
+				break;
+			}
+			case 'f'://file server code
+				fsname = optarg;
+				break;
+			case 'd'://disc image
+				disc = optarg;
+				break;
+			case 'A'://answers to the start up questions
+				fsem_answers(optarg);
+				break;
+			case 'B'://boot benchmark, report to file or -
+				bench = optarg;
+				break;
+			case 'L'://console, file:path or syslog
+				logdest = optarg;
+				break;
+			case 'k'://host memory, KB
+				if (!fsem_hostmem(atoi(optarg))) {
+					fprintf(stderr, "Host memory must be 1 to 63 KB\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'j'://off, wal[:ms] or sync
+				if (!disc_mode(optarg)) {
+					fprintf(stderr, "Bad journal mode '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'c'://on or off
+				if (!disc_crc(optarg)) {
+					fprintf(stderr, "Bad checksum setting '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'R'://cpu=n,iocpu=n,fifo=prio or rr=prio,lock
+				if (!rt_config(optarg)) {
+					fprintf(stderr, "Bad real time option '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'N'://subnet broadcast address
+				if (!aun_broadcast(optarg)) {
+					fprintf(stderr, "Bad broadcast address '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'K'://backup file[:KB/s]
+				backup = optarg;
+				break;
+			case 'S'://SCSI stats file
+				scsistat_export(optarg);
+				break;
+			case 'V'://[cat=]level,...
+				if (!log_levels(optarg)) {
+					fprintf(stderr, "Bad log level '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'r':
+				txlimit = atoi(optarg);
+				if (txlimit < 1)
+					txlimit = 1;
+				break;
+			case 't': {
+				int min = 0, max = 0;
+				sscanf(optarg, "%d,%d", &min, &max);
+				if (!aun_setrto(min, max, 0, 0)) {
+					fprintf(stderr, "Bad retransmit timer '%s', min above max\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'b':
+				backoff = atoi(optarg);
+				if (backoff < 1 || backoff > AUN_RTO_BACKOFFMAX) {
+					fprintf(stderr, "Backoff must be 1 to %d\n", AUN_RTO_BACKOFFMAX);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'm':
+				mapfile = optarg;
+				break;
+			case 'M':
+				sscanf(optarg, "%x:%x", &mtype, &mver);
+				break;
+			case 'n':
+				buffers = atoi(optarg) + 1;//plus the transmit buffer
+				if (buffers < 2 || buffers > EB_MAX_BUFFERS) {
+					fprintf(stderr, "RXCBs must be 1 to %d\n", EB_MAX_BUFFERS - 1);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [options], see README.md for details\n"
+					"  network:    [-s stn_id] [-a ip.address] [-l mode:ip.address[:port]]... [-N broadcast.address] [-n rxcbs]\n"
+					"  retransmit: [-r tx_attempts] [-t min_ms,max_ms] [-b backoff]\n"
+					"  stations:   [-m map_file] [-M machine:version] [-W stn:weight]... [-T max_age_ms] [-I [stn:]key=value,...]...\n"
+					"  server:     [-f fs_file] [-k host_kb] [-A answer,...] [-B report_file] [-R key[=value],...]\n"
+					"  disc:       [-d disc_image] [-j off|wal[:ms]|sync] [-c on|off] [-K backup_file[:kb_per_s]] [-S scsi_stats_file]\n"
+					"  logging:    [-L console|file:path|syslog] [-V [cat=]level,...]\n"
+					"  monitoring: [-o stats_file[:secs]] [-C control_socket] [-P capture_file[:mb[:files]]]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("File Server Emulator\n\n");
+
+	if (bench)//headless, no terminal set up
+		return _bootbench(fsname, disc, my_stn, buffers, bench);
+
+	if (!log_open(logdest))
+		exit(EXIT_FAILURE);
+
+	if (fsem_open(fsname, 0x0400, my_stn, disc)) {
+		char dname[17];
+		if (disc_name(dname))
+			aun_discname(dname);
+		if (mapfile)
+			aun_loadmap(mapfile);
+		aun_setrto(0, 0, backoff, txlimit);
+		imm_setmachine(mtype, mver);
+		if (!nlisten)
+			listen[nlisten++] = "beebem";
+		if (pcapfile)
+			pcap_open(pcapfile, pcapmb, pcapfiles);
+		aun_open(my_stn,buffers,listen,nlisten);
+		rt_thread(RT_EMU);//after the other threads, they don't inherit it
+		rt_lock();
+	
+		struct sigaction sa = {.sa_handler = _sigbackup};
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, NULL);
+
+		set_no_buffer();
+		do {
+			loops++;
+			flg = 0;
+
+			//printf("P %d\n", loops);
+				
+			if (!ex) {
+				rc = fsem_exec(1, 0);//Execute
+				//printf("RC=%d\n", rc);
+				ex = 1;
+				switch (rc) {
+					case FSEM_WAIT0://no timeout, allow key press
+						rx = 1;
+						rxto = 0;
+						break;
+					case FSEM_WAIT1://1 second, for replies to a broadcast
+						rx = 2;
+						rxto = 1000;
+						break;
+					case FSEM_WAIT2://60 second timeout
+						rx = 2;
+						rxto = 60000;
+						break;
+					case FSEM_SEND:
+						tx = 1;
+						break;
+					default:
+						rx = 0;
+						ex = 0;
+						break;
+				}
+			}
+				
+			if (tx) {//queued for the I/O thread, which does the ACKs and retries
+				if (aun_transmitter(&txseq))
+					flg = 3;
+				else
+					flg = 4;
+			}
+			fsem_txstatus(aun_txstatus(txseq));//of the FS's latest
+			fsop_poll();
+			disc_poll();
+			if (backupsig) {
+				backupsig = 0;
+				disc_backup(backup);
+			}
+			aun_publish(fsem_instructions(), fsem_scsiops(), loops);
+			
+			if (rxto > 0) {//Set timeout
+				//printf("SET TIMEOUT TO %d MS\n", rxto);
+				timeout1 = tick_ms() + rxto;
+				rxto = -1;
+			}
+			
+			skey = 0;
+			c = 0;
+			int count = charsWaiting(fileno(stdin));
+			if (count != 0) {
+				c = tolower(getchar());
+				switch (c) {
+					case 'q':
+						printf("Quit\n");
+						break;
+					case 'x':
+						printf("Enable exec\n");
+						ex = 0;
+						rx = 1;
+						break;
+					case 'z':
+						printf("Disable exec\n");
+						ex = 1;
+						break;
+					case 'm'://monitor on/off
+						skey = 'M';
+						break;
+					case 'r'://restart
+						skey = 'Q';
+						break;
+					case 's'://station table
+						aun_stations();
+						break;
+					case 'e'://ebufs
+						ebuf_list();
+						break;
+					case 'w'://request queues
+						sched_stats();
+						break;
+					case 'f'://file server operations
+						fsop_stats(stdout);
+						break;
+					case 'd'://disc I/O
+						scsistat_dump();
+						disc_stats(stdout);
+						break;
+					case 'b'://online backup
+						disc_backup(backup);
+						break;
+				}
+			}
+			
+			if (rxto < 0) {//Check for timeout
+				if ((int32_t) (tick_ms() - timeout1) >= 0) {
+					//printf("RX TIMEOUT\n");
+					flg = 1;
+				}
+			}
+			
+			if (skey && rx != 2) {
+				//printf("SKEY!\n");
+				fsem_sendkey(1, skey);
+				flg = 1;
+			}
+			
+			if (rx) {//Check receiver
+				int wait = RXPOLL_MS, due = disc_due();
+				if (rxto < 0) {
+					int32_t left = timeout1 - tick_ms();
+					wait = (left < 0) ? 0 : (left < wait) ? left : wait;
+				}
+				if (due >= 0 && due < wait)
+					wait = due;//wake up for the group commit
+				if (flg)
+					wait = 0;
+
+				if (aun_receiver(wait))
+					flg = 2;//We've got something
+			}
+			
+			if (flg) {
+				//printf("FLAG = %d\n", flg);
+				//flag set means return to emulator
+				//flg==1 : timeout or key pressed, X=0x00
+				//flg==2 : data received, X=0x80
+				//flg==3 : transmission queued
+				//flg==4 : transmission couldn't be queued
+				if (flg == 1)
+					fsem_loadX(0x00);
+				else if (flg == 2)
+					fsem_loadX(0x80);
+				else if (flg == 3)
+					fsem_loadA(0x00);
+				else
+					fsem_loadA(0x40);//generic error
+				
+				tx = 0;//disable transmitter
+				rx = 0;//disable receiver
+				ex = 0;//enable execution
+				rxto = 0;//stop timer
+				ebuf_listen(0);//stop listening
+			}
+
+		} while (c != 'q');
+	
+		aun_close();
+		pcap_close();
+		fsop_close();
+		scsistat_close();
+		fsem_close();
+	}
+	log_close();
+}
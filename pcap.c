@@ -0,0 +1,246 @@
+/* File Server Emulator   */
+/* pcap.c                 */
+/* (c) 2021 Martin Mather */
+
+/* Capture of AUN datagrams to a pcap file with nanosecond timestamps. */
+/* Each packet gets a made up IPv4/UDP header so tools can decode it,  */
+/* whichever socket it went through.  Records are put in a lock-free   */
+/* ring by the I/O thread and written out by a thread of their own,    */
+/* so capture never waits on the disc.  If the writer falls behind the */
+/* records are dropped and counted.  Files are rotated as they fill.   */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pcap.h"
+
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define REC_HDR	16
+#define IP_HDR	20
+#define UDP_HDR	8
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELEASE)
+
+static uint8_t *ring;
+static unsigned head, tail;//bytes, written by the writer and the I/O thread
+static int running;
+static pthread_t writer;
+
+static char *capname;
+static FILE *fp;
+static long maxbytes, filebytes;
+static int nfiles;
+
+static uint16_t ipid;
+static uint64_t records, dropped;//by the I/O thread
+static uint64_t written, rotations;//by the writer
+
+static void _put32(uint8_t *p, uint32_t v) {//file byte order, which is ours
+	memcpy(p, &v, 4);
+}
+
+static void _be16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void _be32(uint8_t *p, uint32_t v) {
+	_be16(p, v >> 16);
+	_be16(p + 2, v);
+}
+
+static int _header(void) {
+	uint8_t h[24] = {0};
+	uint16_t version[2] = {2, 4};
+
+	_put32(h, PCAP_MAGIC_NS);
+	memcpy(h + 4, version, 4);
+	_put32(h + 16, PCAP_SNAPLEN);
+	_put32(h + 20, PCAP_LINKTYPE_RAW);
+	filebytes = sizeof(h);
+	return fwrite(h, sizeof(h), 1, fp) == 1;
+}
+
+static void _rotate(void) {
+	char from[512], to[512];
+
+	fclose(fp);
+	for (int i = nfiles - 1; i > 0; i--) {
+		if (i > 1)
+			snprintf(from, sizeof(from), "%s.%d", capname, i - 1);
+		else
+			snprintf(from, sizeof(from), "%s", capname);
+		snprintf(to, sizeof(to), "%s.%d", capname, i);
+		rename(from, to);
+	}
+	if (!(fp = fopen(capname, "wb")) || !_header()) {
+		printf("PCAP:Couldn't write '%s', capture stopped\n", capname);
+		if (fp)
+			fclose(fp);
+		fp = NULL;
+	}
+	__atomic_add_fetch(&rotations, 1, __ATOMIC_RELAXED);
+}
+
+static void _copyout(uint8_t *dst, unsigned from, unsigned len) {
+	unsigned at = from & (PCAP_RING - 1), n = PCAP_RING - at;
+
+	if (n > len)
+		n = len;
+	memcpy(dst, ring + at, n);
+	memcpy(dst + n, ring, len - n);
+}
+
+static void _copyin(unsigned to, uint8_t *src, unsigned len) {
+	unsigned at = to & (PCAP_RING - 1), n = PCAP_RING - at;
+
+	if (n > len)
+		n = len;
+	memcpy(ring + at, src, n);
+	memcpy(ring, src + n, len - n);
+}
+
+static void *_writer(void *arg) {
+	uint8_t rec[REC_HDR + PCAP_SNAPLEN];
+	struct timespec idle = {0, 20 * 1000000};//ms
+
+	for (;;) {
+		unsigned h = head, t = LOAD(tail);
+
+		if (h == t) {
+			if (fp)
+				fflush(fp);
+			if (!LOAD(running))
+				return NULL;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		while (h != t) {
+			uint32_t caplen;
+
+			_copyout(rec, h, REC_HDR);
+			memcpy(&caplen, rec + 8, 4);
+			_copyout(rec + REC_HDR, h + REC_HDR, caplen);
+			h += REC_HDR + caplen;
+
+			if (fp && maxbytes && filebytes + REC_HDR + caplen > maxbytes)
+				_rotate();
+			if (fp && fwrite(rec, REC_HDR + caplen, 1, fp) == 1) {
+				filebytes += REC_HDR + caplen;
+				__atomic_add_fetch(&written, 1, __ATOMIC_RELAXED);
+			}
+		}
+		STORE(head, h);
+	}
+}
+
+int pcap_open(char *fname, int max_mb, int files) {
+	capname = fname;
+	maxbytes = (long) (max_mb > 0 ? max_mb : PCAP_MAXFILE) * 1024 * 1024;
+	nfiles = files > 0 ? files : PCAP_FILES;
+
+	if (!(fp = fopen(fname, "wb")) || !_header()) {
+		printf("PCAP:Couldn't write '%s'\n", fname);
+		if (fp)
+			fclose(fp);
+		fp = NULL;
+		return 0;
+	}
+	if (!(ring = malloc(PCAP_RING))) {
+		fclose(fp);
+		fp = NULL;
+		return 0;
+	}
+	running = 1;
+	if (pthread_create(&writer, NULL, _writer, NULL)) {
+		printf("PCAP:Couldn't start the writer\n");
+		running = 0;
+		free(ring);
+		ring = NULL;
+		fclose(fp);
+		fp = NULL;
+		return 0;
+	}
+	printf("PCAP:Capturing to %s (%d x %ldMB)\n", fname, nfiles, maxbytes / 1024 / 1024);
+	return 1;
+}
+
+void pcap_packet(uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport, uint8_t *buf, int len) {
+	//Addresses and ports in host byte order.  Called by the I/O thread only.
+	uint8_t hdr[REC_HDR + IP_HDR + UDP_HDR], *ip = hdr + REC_HDR, *udp = ip + IP_HDR;
+	struct timespec ts;
+	uint32_t sum = 0;
+	unsigned t, caplen;
+
+	if (!running)
+		return;
+	records++;
+	if (len > PCAP_SNAPLEN - IP_HDR - UDP_HDR)
+		len = PCAP_SNAPLEN - IP_HDR - UDP_HDR;
+	caplen = IP_HDR + UDP_HDR + len;
+	t = tail;
+	if (PCAP_RING - (t - LOAD(head)) < REC_HDR + caplen) {
+		dropped++;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	_put32(hdr, ts.tv_sec);
+	_put32(hdr + 4, ts.tv_nsec);
+	_put32(hdr + 8, caplen);
+	_put32(hdr + 12, caplen);
+
+	memset(ip, 0, IP_HDR);
+	ip[0] = 0x45;//v4, 5 words
+	_be16(ip + 2, caplen);
+	_be16(ip + 4, ipid++);
+	ip[6] = 0x40;//don't fragment
+	ip[8] = 64;//ttl
+	ip[9] = 17;//UDP
+	_be32(ip + 12, src);
+	_be32(ip + 16, dst);
+	for (int i = 0; i < IP_HDR; i += 2)
+		sum += ip[i] << 8 | ip[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	_be16(ip + 10, ~sum);
+
+	_be16(udp, sport);
+	_be16(udp + 2, dport);
+	_be16(udp + 4, UDP_HDR + len);
+	_be16(udp + 6, 0);//no checksum
+
+	_copyin(t, hdr, sizeof(hdr));
+	_copyin(t + sizeof(hdr), buf, len);
+	STORE(tail, t + REC_HDR + caplen);
+}
+
+void pcap_stats(void) {
+	if (ring)
+		printf("PCAP:records=%llu written=%llu dropped=%llu rotations=%llu\n",
+			(unsigned long long) records, (unsigned long long) LOAD(written),
+			(unsigned long long) dropped, (unsigned long long) LOAD(rotations));
+}
+
+void pcap_close(void) {
+	if (!ring)
+		return;
+	if (running) {
+		STORE(running, 0);
+		pthread_join(writer, NULL);
+	}
+	pcap_stats();
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+	free(ring);
+	ring = NULL;
+}
@@ -0,0 +1,14 @@
+/* File Server Emulator   */
+/* pcap.h                 */
+/* (c) 2021 Martin Mather */
+
+#define PCAP_RING	(4*1024*1024)	// bytes buffered for the writer, power of 2
+#define PCAP_MAXFILE	64	// MB per file before rotating
+#define PCAP_FILES	4	// files kept, including the current one
+#define PCAP_SNAPLEN	65535
+#define PCAP_LINKTYPE_RAW	101	// starts with the IP header
+
+int pcap_open(char *fname, int max_mb, int files);
+void pcap_packet(uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport, uint8_t *buf, int len);
+void pcap_stats(void);
+void pcap_close(void);
@@ -0,0 +1,53 @@
+/* File Server Emulator   */
+/* ring.c                 */
+/* (c) 2021 Martin Mather */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ring.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELEASE)
+
+int ring_init(struct ring_t *r, unsigned size) {
+	unsigned n = 1;
+	while (n < size)
+		n <<= 1;
+
+	r->slot = calloc(n, sizeof(void *));
+	r->size = n;
+	r->head = r->tail = 0;
+	return r->slot != NULL;
+}
+
+void ring_free(struct ring_t *r) {
+	free(r->slot);
+	r->slot = NULL;
+}
+
+int ring_put(struct ring_t *r, void *p) {
+	unsigned tail = r->tail;
+
+	if (tail - LOAD(r->head) >= r->size)
+		return 0;//full
+
+	r->slot[tail & (r->size - 1)] = p;
+	STORE(r->tail, tail + 1);
+	return 1;
+}
+
+void *ring_get(struct ring_t *r) {
+	unsigned head = r->head;
+
+	if (head == LOAD(r->tail))
+		return NULL;//empty
+
+	void *p = r->slot[head & (r->size - 1)];
+	STORE(r->head, head + 1);
+	return p;
+}
+
+unsigned ring_count(struct ring_t *r) {
+	return LOAD(r->tail) - LOAD(r->head);
+}
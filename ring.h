@@ -0,0 +1,18 @@
+/* File Server Emulator   */
+/* ring.h                 */
+/* (c) 2021 Martin Mather */
+
+/* Single producer, single consumer lock-free ring of pointers. */
+
+struct ring_t {
+	void **slot;
+	unsigned size;//power of 2
+	unsigned head;//next to get, written by the consumer
+	unsigned tail;//next to put, written by the producer
+};
+
+int ring_init(struct ring_t *r, unsigned size);
+void ring_free(struct ring_t *r);
+int ring_put(struct ring_t *r, void *p);//0 if full
+void *ring_get(struct ring_t *r);//NULL if empty
+unsigned ring_count(struct ring_t *r);
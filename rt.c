@@ -0,0 +1,168 @@
+/* File Server Emulator   */
+/* rt.c                   */
+/* (c) 2021 Martin Mather */
+
+/* Keeping the scheduler out of the way.  The emulator and the I/O     */
+/* thread can each be pinned to a CPU and run SCHED_FIFO or SCHED_RR,  */
+/* the I/O thread one priority higher so it can still ACK while the    */
+/* emulator is busy.  Memory can be locked, after the heap and stack   */
+/* have been faulted in so there are no page faults later.  How late   */
+/* each thread wakes from a timed wait is recorded, to show the effect. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+#include "tick.h"
+#include "log.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+
+static int cpus[2] = {-1, -1};//per role
+static int policy = SCHED_OTHER, prio, lock;
+static cpu_set_t allcpus;//as we started, for background threads
+static int haveall;
+
+static struct {//written by the role's own thread, read by the I/O thread
+	uint32_t samples, hist[RT_BUCKETS];
+	uint64_t total_us;
+	uint32_t max_us;
+} late[2];
+
+static const char *roles[] = {"emulator", "io", "background"};
+
+int rt_config(char *spec) {
+	//key[=value],...  eg "cpu=2,iocpu=3,fifo=50,lock"
+	//keys: cpu, iocpu, fifo or rr (priority), lock.  0 if no good.
+	char buf[128], *key;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (key = strtok(buf, ","); key; key = strtok(NULL, ",")) {
+		char *val = strchr(key, '=');
+
+		if (val)
+			*val++ = 0;
+		if (!strcmp(key, "lock"))
+			lock = 1;
+		else if (!val)
+			return 0;
+		else if (!strcmp(key, "cpu"))
+			cpus[RT_EMU] = atoi(val);
+		else if (!strcmp(key, "iocpu"))
+			cpus[RT_IO] = atoi(val);
+		else if (!strcmp(key, "fifo") || !strcmp(key, "rr")) {
+			policy = (key[0] == 'f') ? SCHED_FIFO : SCHED_RR;
+			prio = atoi(val);
+			if (prio < sched_get_priority_min(policy) || prio + 1 > sched_get_priority_max(policy))
+				return 0;
+		} else
+			return 0;
+	}
+	if (cpus[RT_EMU] >= 0 || cpus[RT_IO] >= 0)//before anything's pinned
+		haveall = !sched_getaffinity(0, sizeof(allcpus), &allcpus);
+	return 1;
+}
+
+void rt_thread(int role) {
+	//Apply the settings to the calling thread.
+	struct sched_param sp = {0};
+	int rc;
+
+	if (role == RT_BACKGROUND) {//created by an RT thread, so it inherited
+		if (policy != SCHED_OTHER)
+			pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+		if (haveall)//and its CPU
+			pthread_setaffinity_np(pthread_self(), sizeof(allcpus), &allcpus);
+		return;
+	}
+
+	if (cpus[role] >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpus[role], &set);
+		if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+			log_msg(LOGC_FSEM, LOGL_WARN, "Couldn't pin %s thread to CPU %d: %s", roles[role], cpus[role], strerror(rc));
+	}
+	if (policy != SCHED_OTHER) {
+		sp.sched_priority = prio + (role == RT_IO);
+		if ((rc = pthread_setschedparam(pthread_self(), policy, &sp)))
+			log_msg(LOGC_FSEM, LOGL_WARN, "Couldn't set %s thread priority: %s", roles[role], strerror(rc));
+	}
+}
+
+void rt_lock(void) {
+	//Fault in and keep the heap and stack, then lock everything, now and later.
+	volatile uint8_t stack[256 * 1024];
+	uint8_t *heap;
+
+	if (!lock)
+		return;
+
+	mallopt(M_TRIM_THRESHOLD, -1);//never give heap back
+	mallopt(M_MMAP_MAX, 0);//so big blocks come from it too
+	if ((heap = malloc(RT_PREFAULT))) {
+		for (int i = 0; i < RT_PREFAULT; i += 4096)
+			heap[i] = 0;
+		free(heap);
+	}
+	for (int i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		log_msg(LOGC_FSEM, LOGL_WARN, "Couldn't lock memory: %s", strerror(errno));
+}
+
+void rt_wake(int role, int wait_ms, uint64_t start_us) {
+	//A timed wait that started at start_us has timed out, how late was it?
+	uint64_t now = tick_us(), due = start_us + wait_ms * 1000ull;
+	uint32_t us = (now > due) ? now - due : 0;
+	int b = 0;
+
+	for (uint32_t v = us; v > 1 && b < RT_BUCKETS - 1; v >>= 1)
+		b++;
+	STORE(late[role].samples, late[role].samples + 1);
+	STORE(late[role].hist[b], late[role].hist[b] + 1);
+	STORE(late[role].total_us, late[role].total_us + us);
+	if (us > late[role].max_us)
+		STORE(late[role].max_us, us);
+}
+
+static uint32_t _permille(int role, uint32_t samples, int pm) {
+	//upper bound of the bucket holding the pm'th permille, us
+	uint32_t n = 0;
+
+	for (int b = 0; b < RT_BUCKETS; b++) {
+		n += LOAD(late[role].hist[b]);
+		if (n * 1000ull >= (uint64_t) samples * pm)
+			return (b == RT_BUCKETS - 1) ? LOAD(late[role].max_us) : 2u << b;
+	}
+	return LOAD(late[role].max_us);//still being counted
+}
+
+void rt_stats(void) {
+	static const char *policies[] = {"other", "fifo", "rr"};
+
+	for (int r = RT_EMU; r <= RT_IO; r++) {
+		uint32_t samples = LOAD(late[r].samples);
+
+		printf("RT:%-8s policy=%s cpu=%d timed wakeups=%u late", roles[r],
+			policy < 3 ? policies[policy] : "?", cpus[r], samples);
+		if (samples)
+			printf(" mean=%lluus p50<%uus p99<%uus p99.9<%uus max=%uus",
+				(unsigned long long) (LOAD(late[r].total_us) / samples),
+				_permille(r, samples, 500), _permille(r, samples, 990), _permille(r, samples, 999),
+				LOAD(late[r].max_us));
+		printf("\n");
+	}
+}
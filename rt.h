@@ -0,0 +1,18 @@
+/* File Server Emulator   */
+/* rt.h                   */
+/* (c) 2021 Martin Mather */
+
+#include <stdint.h>
+
+#define RT_EMU	0	// the emulator, main thread
+#define RT_IO	1	// the AUN I/O thread
+#define RT_BACKGROUND	2	// helpers that mustn't compete with the other two
+
+#define RT_BUCKETS	20	// log2 us wake up latency buckets, the last is 0.5s and over
+#define RT_PREFAULT	(8 * 1024 * 1024)	// heap to fault in and keep
+
+int rt_config(char *spec);
+void rt_thread(int role);
+void rt_lock(void);
+void rt_wake(int role, int wait_ms, uint64_t start_us);
+void rt_stats(void);
@@ -0,0 +1,204 @@
+/* File Server Emulator   */
+/* sched.c                */
+/* (c) 2021 Martin Mather */
+
+/* Requests to the file server command port are queued per station and */
+/* handed to the FS by deficit round robin, so one busy station can't   */
+/* starve the others.  A station's weight is the number of requests it */
+/* gets per round (default 1).                                          */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sched.h"
+#include "aun.h"
+#include "tick.h"
+
+struct sitem_t {
+	void *item;
+	uint32_t time;//ms, when received
+	struct sitem_t *next;
+};
+
+static struct squeue_t {
+	uint16_t stn;
+	int weight, deficit;
+	struct sitem_t *head, *tail;
+	int depth;
+	struct squeue_t *prev, *next;//active ring
+
+	uint32_t served, dropped, maxdepth;
+	uint64_t waited;//ms, total
+	uint32_t maxwait;//ms
+	struct squeue_t *all;
+} *queues[AUN_MAX_STATIONS], *cur, *qlist;
+
+static int maxage = SCHED_MAXAGE;
+static void (*dropitem)(void *item);
+
+static struct squeue_t *_queue(uint16_t stn) {
+	struct squeue_t *q = queues[stn];
+
+	if (!q && (q = calloc(1, sizeof(struct squeue_t)))) {
+		q->stn = stn;
+		q->weight = 1;
+		q->all = qlist;
+		qlist = q;
+		queues[stn] = q;
+	}
+	return q;
+}
+
+static void _activate(struct squeue_t *q) {//join the ring behind cur
+	if (!cur) {
+		q->prev = q->next = q;
+		q->deficit = q->weight;
+		cur = q;
+	} else {
+		q->next = cur;
+		q->prev = cur->prev;
+		cur->prev->next = q;
+		cur->prev = q;
+		q->deficit = 0;
+	}
+}
+
+static void _advance(int leave) {//move on to the next station
+	struct squeue_t *q = cur;
+
+	if (leave) {
+		q->deficit = 0;
+		if (q->next == q)
+			cur = NULL;
+		else {
+			q->prev->next = q->next;
+			q->next->prev = q->prev;
+			cur = q->next;
+		}
+		q->prev = q->next = NULL;
+	} else
+		cur = q->next;
+
+	if (cur)
+		cur->deficit += cur->weight;
+}
+
+static void _unhead(struct squeue_t *q) {
+	struct sitem_t *i = q->head;
+	q->head = i->next;
+	if (!q->head)
+		q->tail = NULL;
+	q->depth--;
+	free(i);
+}
+
+void sched_open(void (*drop)(void *item)) {
+	dropitem = drop;
+}
+
+int sched_maxage(int maxage_ms) {
+	//0 or less leaves it alone.  Returns the age in use, which is only
+	//set before the threads start so the I/O thread can read it too.
+	if (maxage_ms > 0)
+		maxage = maxage_ms;
+	return maxage;
+}
+
+void sched_close(void) {
+	while (qlist) {
+		struct squeue_t *q = qlist;
+		while (q->head) {
+			dropitem(q->head->item);
+			_unhead(q);
+		}
+		qlist = q->all;
+		queues[q->stn] = NULL;
+		free(q);
+	}
+	cur = NULL;
+}
+
+void sched_weight(uint16_t stn, int weight) {
+	struct squeue_t *q = _queue(stn);
+	if (q && weight > 0)
+		q->weight = weight;
+}
+
+int sched_put(uint16_t stn, void *item, uint32_t time) {
+	//Returns 0 if it couldn't be queued (and the caller still owns it)
+	struct squeue_t *q = _queue(stn);
+	struct sitem_t *i;
+
+	if (!q)
+		return 0;
+
+	if (q->depth >= SCHED_DEPTH || !(i = malloc(sizeof(struct sitem_t)))) {
+		q->dropped++;
+		dropitem(item);
+		return 1;
+	}
+
+	i->item = item;
+	i->time = time;
+	i->next = NULL;
+	if (q->tail)
+		q->tail->next = i;
+	else {
+		q->head = i;
+		_activate(q);
+	}
+	q->tail = i;
+
+	if (++q->depth > q->maxdepth)
+		q->maxdepth = q->depth;
+	return 1;
+}
+
+void *sched_peek(void) {//next request to give the FS
+	uint32_t now = tick_ms();
+
+	while (cur) {
+		struct squeue_t *q = cur;
+
+		while (q->head && (int32_t) (now - q->head->time) > maxage) {
+			//printf("SCHED:stale request from %d.%d\n", AUN_NET(q->stn), AUN_STN(q->stn));
+			q->dropped++;
+			dropitem(q->head->item);
+			_unhead(q);
+		}
+
+		if (!q->head)
+			_advance(1);
+		else if (q->deficit <= 0)
+			_advance(0);
+		else
+			return q->head->item;
+	}
+	return NULL;
+}
+
+void sched_pop(void) {//the one from sched_peek has been taken
+	struct squeue_t *q = cur;
+	uint32_t wait = tick_ms() - q->head->time;
+
+	q->served++;
+	q->waited += wait;
+	if (wait > q->maxwait)
+		q->maxwait = wait;
+
+	_unhead(q);
+	q->deficit--;
+	if (!q->head)
+		_advance(1);
+	else if (q->deficit <= 0)
+		_advance(0);
+}
+
+void sched_stats(void) {
+	for (struct squeue_t *q = qlist; q; q = q->all) {
+		printf("SCHED:stn %3d.%-3d weight=%d depth=%d maxdepth=%u served=%u dropped=%u avgwait=%ums maxwait=%ums\n",
+			AUN_NET(q->stn), AUN_STN(q->stn), q->weight, q->depth, q->maxdepth, q->served, q->dropped,
+			q->served ? (unsigned) (q->waited / q->served) : 0, q->maxwait);
+	}
+}
@@ -0,0 +1,16 @@
+/* File Server Emulator   */
+/* sched.h                */
+/* (c) 2021 Martin Mather */
+
+#define SCHED_PORT	0x99	// file server command port
+#define SCHED_DEPTH	8	// requests queued per station
+#define SCHED_MAXAGE	5000	// ms, older requests have been given up on by the client
+
+void sched_open(void (*drop)(void *item));
+int sched_maxage(int maxage_ms);
+void sched_close(void);
+void sched_weight(uint16_t stn, int weight);
+int sched_put(uint16_t stn, void *item, uint32_t time);
+void *sched_peek(void);
+void sched_pop(void);
+void sched_stats(void);
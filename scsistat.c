@@ -0,0 +1,148 @@
+/* File Server Emulator   */
+/* scsistat.c             */
+/* (c) 2021 Martin Mather */
+
+/* Where the file server's disc time goes.  Each SCSI read or write is */
+/* timed and sized, marked sequential if it starts where the previous  */
+/* command finished, and its sectors are added to one of SCSI_BANDS     */
+/* equal ranges of the disc so the busy areas (maps, catalogues, user  */
+/* files) show up.  Only the emulator thread calls these.              */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "scsistat.h"
+#include "log.h"
+
+static struct dirstat_t {
+	uint32_t count, errors, sequential;
+	uint32_t hist[SCSI_BUCKETS];
+	uint32_t sizes[SCSI_SIZES];
+	uint64_t total_us, sectors;
+	uint32_t max_us;
+	uint64_t bands[SCSI_BANDS];//sectors
+} dirs[2];
+
+static const char *dirnames[2] = {"read", "write"};
+static uint32_t bandsize = 1, nextsec = UINT32_MAX;
+static char *expname;
+
+static int _log2(uint32_t v, int max) {
+	int b = 0;
+
+	while (v > 1 && b < max - 1) {
+		v >>= 1;
+		b++;
+	}
+	return b;
+}
+
+void scsistat_export(char *fname) {
+	//Write the stats to fname on demand and at close.
+	expname = fname;
+}
+
+void scsistat_disc(uint32_t sectors) {
+	bandsize = (sectors + SCSI_BANDS - 1) / SCSI_BANDS;
+	if (!bandsize)
+		bandsize = 1;
+}
+
+void scsistat_io(int write, uint32_t sec, uint32_t count, uint32_t us) {
+	//count is the sectors actually moved, 0 if it failed
+	struct dirstat_t *d = &dirs[write ? 1 : 0];
+
+	d->count++;
+	d->hist[_log2(us, SCSI_BUCKETS)]++;
+	d->total_us += us;
+	if (us > d->max_us)
+		d->max_us = us;
+	if (!count) {
+		d->errors++;
+		return;
+	}
+
+	d->sizes[_log2(count, SCSI_SIZES)]++;
+	d->sectors += count;
+	if (sec == nextsec)
+		d->sequential++;
+	nextsec = sec + count;
+
+	while (count) {//split across the bands it touches
+		uint32_t band = sec / bandsize, n = (band + 1) * bandsize - sec;
+
+		if (n > count)
+			n = count;
+		d->bands[band < SCSI_BANDS ? band : SCSI_BANDS - 1] += n;
+		sec += n;
+		count -= n;
+	}
+}
+
+static uint32_t _percentile(struct dirstat_t *d, int pc) {
+	//upper bound of the bucket holding the pc'th percentile, us
+	uint32_t n = 0;
+
+	for (int b = 0; b < SCSI_BUCKETS; b++) {
+		n += d->hist[b];
+		if (n * 100 >= d->count * pc)
+			return (b == SCSI_BUCKETS - 1) ? d->max_us : 2u << b;
+	}
+	return 0;
+}
+
+void scsistat_stats(FILE *f) {
+	for (int w = 0; w < 2; w++) {
+		struct dirstat_t *d = &dirs[w];
+		uint32_t good = d->count - d->errors;
+
+		fprintf(f, "SCSI:%-5s count=%u errors=%u sectors=%llu", dirnames[w], d->count, d->errors,
+			(unsigned long long) d->sectors);
+		if (d->count)
+			fprintf(f, " mean=%lluus p50<%uus p99<%uus max=%uus",
+				(unsigned long long) (d->total_us / d->count), _percentile(d, 50), _percentile(d, 99), d->max_us);
+		if (good)
+			fprintf(f, " sequential=%u%%", (unsigned) (d->sequential * 100ull / good));
+		fprintf(f, " hist=");
+		for (int b = 0; b < SCSI_BUCKETS; b++)
+			fprintf(f, "%s%u", b ? "," : "", d->hist[b]);
+		fprintf(f, " sizes=");
+		for (int b = 0; b < SCSI_SIZES; b++)
+			fprintf(f, "%s%u", b ? "," : "", d->sizes[b]);
+		fprintf(f, "\n");
+	}
+
+	//heatmap, sectors read and written in each band that saw any
+	for (int b = 0; b < SCSI_BANDS; b++)
+		if (dirs[0].bands[b] || dirs[1].bands[b])
+			fprintf(f, "SCSI:band %06x-%06x read=%llu write=%llu\n", b * bandsize, (b + 1) * bandsize - 1,
+				(unsigned long long) dirs[0].bands[b], (unsigned long long) dirs[1].bands[b]);
+}
+
+static void _export(void) {
+	char tmp[512];
+	FILE *f;
+
+	if (!expname)
+		return;
+	//write it all, then swap it in, so a reader never sees half a file
+	snprintf(tmp, sizeof(tmp), "%s.tmp", expname);
+	if (!(f = fopen(tmp, "w"))) {
+		log_msg(LOGC_DISC, LOGL_WARN, "Couldn't write SCSI statistics '%s'", tmp);
+		expname = NULL;
+		return;
+	}
+	scsistat_stats(f);
+	fclose(f);
+	rename(tmp, expname);
+}
+
+void scsistat_dump(void) {
+	//On demand, to the console and the export file if there is one.
+	scsistat_stats(stdout);
+	_export();
+}
+
+void scsistat_close(void) {
+	_export();
+}
@@ -0,0 +1,14 @@
+/* File Server Emulator   */
+/* scsistat.h             */
+/* (c) 2021 Martin Mather */
+
+#define SCSI_BUCKETS	20	// log2 us latency buckets, the last is 0.5s and over
+#define SCSI_SIZES	9	// log2 sector transfer sizes, 1 to 256
+#define SCSI_BANDS	64	// heatmap bands across the disc
+
+void scsistat_export(char *fname);
+void scsistat_disc(uint32_t sectors);
+void scsistat_io(int write, uint32_t sec, uint32_t count, uint32_t us);
+void scsistat_stats(FILE *f);
+void scsistat_dump(void);
+void scsistat_close(void);
@@ -0,0 +1,20 @@
+/* File Server Emulator   */
+/* tick.c                 */
+/* (c) 2021 Martin Mather */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <time.h>
+
+#include "tick.h"
+
+uint64_t tick_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t tick_ms(void) {
+	return tick_us() / 1000;
+}
@@ -0,0 +1,8 @@
+/* File Server Emulator   */
+/* tick.h                 */
+/* (c) 2021 Martin Mather */
+
+#include <stdint.h>
+
+uint32_t tick_ms(void);//monotonic milliseconds (wraps)
+uint64_t tick_us(void);//monotonic microseconds